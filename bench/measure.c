@@ -0,0 +1,96 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * measure - run a command and report the resources it used
+ *
+ * Usage: measure [-i INPUT] [-o OUTPUT] COMMAND [ARG...]
+ *
+ * The command's standard input and output are redirected to INPUT and
+ * OUTPUT (default: /dev/null). One line is printed with the wall clock,
+ * user and system time in seconds, the peak resident set size in KiB (of
+ * the command or any of its descendants, whichever was largest), and the
+ * exit status, separated by tabs. A command killed by a signal has the
+ * status 128 + the signal number, like in the shell.
+ */
+
+#define _GNU_SOURCE /* for wait4 */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: measure [-i INPUT] [-o OUTPUT] COMMAND [ARG...]\n");
+	exit(EXIT_FAILURE);
+}
+
+static void redirect(const char *file, int flags, int fd)
+{
+	int new_fd = open(file, flags, 0666);
+
+	if (new_fd < 0) {
+		fprintf(stderr, "measure: Can't open '%s': %s\n", file,
+				strerror(errno));
+		_exit(127);
+	}
+	dup2(new_fd, fd);
+	close(new_fd);
+}
+
+static double seconds(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	const char *input = "/dev/null", *output = "/dev/null";
+	struct timespec start, end;
+	struct rusage ru;
+	int opt, status;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "+i:o:")) != -1) {
+		switch (opt) {
+		case 'i': input = optarg; break;
+		case 'o': output = optarg; break;
+		default: usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "measure: Can't fork: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	} else if (pid == 0) {
+		redirect(input, O_RDONLY, STDIN_FILENO);
+		redirect(output, O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO);
+		execvp(argv[optind], argv + optind);
+		fprintf(stderr, "measure: Can't run '%s': %s\n", argv[optind],
+				strerror(errno));
+		_exit(127);
+	}
+
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		fprintf(stderr, "measure: wait4 failed: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%.6f\t%.6f\t%.6f\t%ld\t%d\n",
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+		seconds(ru.ru_utime), seconds(ru.ru_stime), ru.ru_maxrss,
+		WIFEXITED(status)? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,38 @@
+{ a Brainfuck interpreter, running the program on its input 50000 times
+
+  The program is kept on the stack, with its first character at the
+  bottom; the tape consists of the variables a to u. }
+
+{ v: program length, w: program counter, x: tape position,
+  y: bracket depth, z: repetitions left }
+
+0v: [^$1_=~][v;1+v:]# %
+
+50000z:
+[z;0>][
+	0x:[21x;>][0x;:x;1+x:]#		{ clear the tape }
+	0x: 0w:
+	[v;w;>][
+		v;1-w;-ø
+		$'+=[x;;1+x;:]?
+		$'-=[x;;1-x;:]?
+		$'>=[x;1+x:]?
+		$'<=[x;1-x:]?
+		$'.=[x;;,]?
+		$'[=[x;;0=[
+			1y:[y;][
+				w;1+w: v;w;-ø
+				$'[=[y;1+y:]? ']=[y;1-y:]?
+			]#
+		]?]?
+		$']=[x;;0=~[
+			1y:[y;][
+				w;1-w: v;w;-ø
+				$']=[y;1+y:]? '[=[y;1-y:]?
+			]#
+		]?]?
+		%
+		w;1+w:
+	]#
+	z;1-z:
+]#
@@ -0,0 +1,5 @@
+{ recursive Fibonacci: lots of small, non-tail calls }
+
+[$1>[$1-f;!\2-f;!+]?]f:
+
+35f;!.10,
@@ -0,0 +1,10 @@
+{ lambdas that run themselves and each other in '?' bodies through
+  variables: f is known where it runs itself, but may not be inlined into
+  itself, and the chain is inlined until the function is big enough }
+
+[$." "1-$f;?]f: 10$f;?%10,
+
+[1+]a: [1a;?1a;?]b: [1b;?1b;?]c: [1c;?1c;?]d: [1d;?1d;?]e:
+[1e;?1e;?]g: [1g;?1g;?]h: [1h;?1h;?]i: [1i;?1i;?]j: [1j;?1j;?]k:
+[1k;?1k;?]l: [1l;?1l;?]m: [1m;?1m;?]n: [1n;?1n;?]o: [1o;?1o;?]p:
+0 1p;?.10,
@@ -0,0 +1,9 @@
+{ formatted output: lots of small strings, numbers and characters }
+
+0i:
+[1000000i;>][
+	"line "i;." of "1000000.": "
+	i;7&[$0>][1-'*,]#%
+	10,
+	i;1+i:
+]#
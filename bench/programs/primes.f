@@ -0,0 +1,16 @@
+{ count the primes below 1000000 by trial division }
+
+{ p: is n prime? f is the answer, d the divisor being tried }
+[n:
+	n;2= n;1> n;2/2*n;=~ & | f:	{ 2, or odd and greater than 1 }
+	3d:
+	[f; d;d;*n;>~ &][		{ no divisor so far, and d*d <= n }
+		n;d;/d;*n;=[0f:]?
+		d;2+d:
+	]#
+	f;
+]p:
+
+0c: 2k:
+[1000000k;>][k;p;![c;1+c:]? k;1+k:]#
+c;.10,
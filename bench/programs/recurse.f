@@ -0,0 +1,7 @@
+{ deep recursion: count down from 100000 without tail calls, 50 times }
+
+[$0>[1-r;!1+]?]r:
+
+0s: 0i:
+[50i;>][100000r;!s;+s: i;1+i:]#
+s;.10,
@@ -0,0 +1,9 @@
+{ a deep False stack: push a million numbers and add them up, 20 times }
+
+0s: 0r:
+[20r;>][
+	0i:[1000000i;>][i;i;1+i:]#
+	[i;1>][+i;1-i:]#
+	s;+s: r;1+r:
+]#
+s;.10,
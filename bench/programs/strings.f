@@ -0,0 +1,7 @@
+{ strings in a literal lambda that is inlined into lambdas that --tiered
+  compiles in different batches }
+
+[["x"]$l:1\?]a: a;!
+0i:[200000i;>][l;! i;1+i:]#
+0i:[200000i;>][a;! i;1+i:]#
+10,
@@ -0,0 +1,4 @@
+{ tail recursion in the usual form, deeper than the native stack would
+  allow if the calls weren't tail calls }
+
+[$0>[1-f;!]?]f: 3000000f;!.10,
@@ -0,0 +1,148 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0
+#
+# run.sh - benchmark llfalse on the programs in bench/programs
+#
+# usage: run.sh [-n RUNS] [-f tsv|json] [-p PATH,...] [PROGRAM.f...]
+#
+# Every program is compiled and run in each of these ways ("paths"):
+#
+#   falsec   falsec.sh builds an executable ("compile"), which is run ("run")
+#   falsei   falsei.sh compiles the program in memory and runs it ("total")
+#   run-O0   llfalse -O0 --run, unoptimized ("total")
+#   interp   llfalse --interpret, without LLVM ("total")
+#   tiered   llfalse -O2 --tiered, which compiles the hot lambdas ("total")
+#   cached   llfalse -O2 --run with a warm --cache ("total")
+#
+# Each measurement is repeated RUNS times (default: 5) and printed as one
+# record with these fields:
+#
+#   program path phase run wall user sys maxrss status
+#
+# Times are in seconds, maxrss is the peak resident set size in KiB, and
+# status is "ok", "exit N" if the command failed, or "wrong-output" if the
+# checksum of a program's output (see cksum(1)) differs from the one in
+# programs/NAME.cksum. Programs read their input from programs/NAME.in, if
+# there is one. The output is tab-separated with a
+# header line (-f tsv, the default) or one JSON object per line (-f json).
+#
+# llfalse, falsec.sh and falsei.sh are taken from $LLFALSE_DIR, which
+# defaults to the directory above this script.
+
+bench=$(cd "$(dirname "$0")" && pwd)
+dir=${LLFALSE_DIR:-$(dirname "$bench")}
+measure=$bench/measure
+runs=5
+format=tsv
+paths=falsec,falsei,run-O0,interp,tiered,cached
+
+while getopts n:f:p: opt; do
+	case $opt in
+	n) runs=$OPTARG ;;
+	f) format=$OPTARG ;;
+	p) paths=$OPTARG ;;
+	*) sed -n 's/^# usage: /usage: /p' "$0" >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# = 0 ] && set -- "$bench"/programs/*.f
+
+case $format in
+tsv|json) ;;
+*) echo "run.sh: unknown format '$format'" >&2; exit 1 ;;
+esac
+
+if [ ! -x "$measure" ] || [ ! -x "$dir/llfalse" ]; then
+	echo "run.sh: build llfalse and bench/measure first (make bench)" >&2
+	exit 1
+fi
+
+work=$(mktemp -d /tmp/llfalse-bench-XXXXXX) || exit 1
+trap 'rm -rf "$work"' EXIT
+trap 'exit 1' INT TERM
+
+if [ $format = tsv ]; then
+	printf 'program\tpath\tphase\trun\twall\tuser\tsys\tmaxrss\tstatus\n'
+fi
+
+# record PROGRAM PATH PHASE RUN CKSUM-FILE MEASUREMENT
+record() {
+	set -- "$1" "$2" "$3" "$4" "$5" $6
+	status=ok
+	if [ "${10}" != 0 ]; then
+		status="exit ${10}"
+	elif [ -n "$5" ] && [ "$(cksum <"$work/out")" != "$(cat "$5")" ]; then
+		status=wrong-output
+	fi
+
+	if [ $format = tsv ]; then
+		printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n' \
+			"$1" "$2" "$3" "$4" "$6" "$7" "$8" "$9" "$status"
+	else
+		printf '{"program":"%s","path":"%s","phase":"%s","run":%s,' \
+			"$1" "$2" "$3" "$4"
+		printf '"wall":%s,"user":%s,"sys":%s,"maxrss":%s,"status":"%s"}\n' \
+			"$6" "$7" "$8" "$9" "$status"
+	fi
+}
+
+for prog in "$@"; do
+	name=$(basename "$prog" .f)
+	input=${prog%.f}.in
+	[ -f "$input" ] || input=/dev/null
+	expected=${prog%.f}.cksum
+	[ -f "$expected" ] || expected=
+
+	# falsec.sh puts the executable next to the source
+	cp "$prog" "$work/$name.f"
+	rm -rf "$work/cache"
+	"$dir/llfalse" -O2 --cache="$work/cache" --emit=obj -o /dev/null \
+		"$prog" </dev/null
+
+	for path in $(echo "$paths" | tr , ' '); do
+		i=1
+		while [ $i -le $runs ]; do
+			case $path in
+			falsec)
+				rm -f "$work/$name.f.bin"
+				m=$("$measure" "$dir/falsec.sh" "$work/$name.f")
+				record "$name" $path compile $i "" "$m"
+				m=$("$measure" -i "$input" -o "$work/out" \
+					"$work/$name.f.bin")
+				record "$name" $path run $i "$expected" "$m"
+				;;
+			falsei)
+				m=$("$measure" -i "$input" -o "$work/out" \
+					"$dir/falsei.sh" "$prog")
+				record "$name" $path total $i "$expected" "$m"
+				;;
+			run-O0)
+				m=$("$measure" -i "$input" -o "$work/out" \
+					"$dir/llfalse" -O0 --run "$prog")
+				record "$name" $path total $i "$expected" "$m"
+				;;
+			interp)
+				m=$("$measure" -i "$input" -o "$work/out" \
+					"$dir/llfalse" --interpret "$prog")
+				record "$name" $path total $i "$expected" "$m"
+				;;
+			tiered)
+				m=$("$measure" -i "$input" -o "$work/out" \
+					"$dir/llfalse" -O2 --tiered "$prog")
+				record "$name" $path total $i "$expected" "$m"
+				;;
+			cached)
+				m=$("$measure" -i "$input" -o "$work/out" \
+					"$dir/llfalse" -O2 --cache="$work/cache" \
+					--run "$prog")
+				record "$name" $path total $i "$expected" "$m"
+				;;
+			*)
+				echo "run.sh: unknown path '$path'" >&2
+				exit 1
+				;;
+			esac
+			i=$((i + 1))
+		done
+	done
+done
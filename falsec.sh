@@ -7,5 +7,4 @@ if [ $# != 1 ]; then
 	exit 1
 fi
 
-cat $1 | `dirname $0`/llfalse | opt -O2 > "$1.bc" || exit 1
-llc --relocation-model=pic "$1.bc" && gcc -L . "$1.s" -lfalse -o "$1.bin"
+`dirname $0`/llfalse -O2 --emit=exe -o "$1.bin" < $1
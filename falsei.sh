@@ -5,10 +5,9 @@
 # falsei.sh - a simple llfalse based False interpreter
 # usage: falsei.sh FILE.F
 
-dir=$(dirname "$0")
+if [ $# != 1 ]; then
+	echo usage: falsei.sh FILE.F
+	exit 1
+fi
 
-tmpfile=$(mktemp)
-
-$dir/llfalse < $1 opt -O2 > $tmpfile
-lli -load=$dir/libfalse.so $tmpfile
-rm $tmpfile
+exec "$(dirname "$0")"/llfalse -O2 --run "$1"
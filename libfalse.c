@@ -3,37 +3,421 @@
  * Copyright (C) 2012-2013  Jonathan Neuschäfer <j.neuschaefer@gmx.net>
  *
  * libfalse - the llfalse helper library
+ *
+ * Input and output are buffered here instead of going through stdio, because
+ * False programs read and write one character at a time. The output buffer is
+ * flushed when it's full, by 'B', before reading input, and at exit.
+ *
+ * The False stack lives in an mmap'd region between two guard pages, so that
+ * overflows and underflows fault instead of silently corrupting memory. The
+ * SIGSEGV handler tells these faults apart from other crashes and reports
+ * them.
  */
 
+#define _GNU_SOURCE /* for MAP_NORESERVE and REG_RIP */
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "libfalse.h"
+
+#define OUT_BUFSIZE 65536
+#define IN_BUFSIZE 65536
+
+static unsigned char out_buf[OUT_BUFSIZE];
+static size_t out_len;
+
+static unsigned char in_buf[IN_BUFSIZE];
+static size_t in_pos, in_len;
+static int in_eof;
+
+static void write_all(int fd, const void *data, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, data, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return; /* nowhere to go, drop the rest */
+		data = (const unsigned char *) data + ret;
+		len -= ret;
+	}
+}
+
+static void flush_output(void)
+{
+	write_all(STDOUT_FILENO, out_buf, out_len);
+	out_len = 0;
+}
+
+__attribute__((constructor))
+static void lf_init(void)
+{
+	atexit(flush_output);
+}
+
+static void put_bytes(const void *data, size_t len)
+{
+	if (out_len + len > OUT_BUFSIZE) {
+		flush_output();
+		if (len > OUT_BUFSIZE) {
+			/* too big for the buffer anyway */
+			write_all(STDOUT_FILENO, data, len);
+			return;
+		}
+	}
+
+	memcpy(out_buf + out_len, data, len);
+	out_len += len;
+}
+
+/* format num in decimal, right-aligned before end; returns the first digit */
+static char *format_unsigned(char *end, uint32_t num)
+{
+	char *p = end;
+
+	do {
+		*--p = '0' + num % 10;
+		num /= 10;
+	} while (num);
+
+	return p;
+}
 
-/* TODO: add signedness flag */
 void lf_printnum(uint32_t num)
 {
-	printf("%ld", (long) num);
+	char buf[sizeof("-4294967296")], *end = buf + sizeof(buf), *p;
+	int32_t snum = (int32_t) num;
+
+	if (snum < 0) {
+		p = format_unsigned(end, -(uint32_t) num);
+		*--p = '-';
+	} else {
+		p = format_unsigned(end, num);
+	}
+
+	put_bytes(p, end - p);
+}
+
+void lf_printunum(uint32_t num)
+{
+	char buf[sizeof("4294967296")], *end = buf + sizeof(buf), *p;
+
+	p = format_unsigned(end, num);
+	put_bytes(p, end - p);
 }
 
 void lf_printstring(const char *str)
 {
-	printf("%s", str);
+	put_bytes(str, strlen(str));
 }
 
 void lf_putchar(uint32_t ch)
 {
-	putchar((int)ch);
+	if (out_len == OUT_BUFSIZE)
+		flush_output();
+	out_buf[out_len++] = (unsigned char) ch;
 }
 
 uint32_t lf_getchar(void)
 {
-	int ch = getchar();
-	if (ch == EOF)
-		return ~0;
-	return (uint32_t) ch;
+	ssize_t ret;
+
+	if (in_pos == in_len) {
+		if (in_eof)
+			return ~0;
+
+		/* the user might have to see a prompt first */
+		flush_output();
+
+		do {
+			ret = read(STDIN_FILENO, in_buf, IN_BUFSIZE);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret <= 0) {
+			/* don't try again on a terminal after ^D */
+			in_eof = 1;
+			return ~0;
+		}
+		in_pos = 0;
+		in_len = ret;
+	}
+
+	return in_buf[in_pos++];
 }
 
 void lf_flush(void)
 {
-	fflush(stdin);
-	fflush(stdout);
+	flush_output();
+}
+
+/* the signal handler needs a stack of its own, per thread */
+static void setup_altstack(void)
+{
+	stack_t ss;
+
+	ss.ss_size = SIGSTKSZ > 65536? SIGSTKSZ : 65536;
+	ss.ss_sp = malloc(ss.ss_size);
+	ss.ss_flags = 0;
+	if (ss.ss_sp)
+		sigaltstack(&ss, NULL);
+}
+
+static void *run_thread(void *fn)
+{
+	setup_altstack();
+	((void (*)(void)) fn)();
+	return NULL;
+}
+
+void lf_run(void (*fn)(void), uint64_t stack_size)
+{
+	static const char msg[] = "libfalse: can't create the program thread\n";
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	/* function pointers can't portably be passed as void *, but POSIX
+	   (dlsym) needs this to work anyway */
+	if (pthread_attr_init(&attr) ||
+	    pthread_attr_setstacksize(&attr, stack_size) ||
+	    pthread_create(&thread, &attr, run_thread, (void *) fn)) {
+		write_all(STDERR_FILENO, msg, sizeof(msg) - 1);
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_join(thread, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+#define GUARD_SIZE 65536
+
+static unsigned char *stack_region;
+static size_t stack_region_size;
+
+static void (*const *stack_lambdas)(void);
+static const uint32_t *stack_lambda_pos;
+static uint32_t stack_n_lambdas;
+
+static void put_error(const char *str)
+{
+	write_all(STDERR_FILENO, str, strlen(str));
+}
+
+static void put_error_num(uint32_t num)
+{
+	char buf[sizeof("4294967296")], *end = buf + sizeof(buf), *p;
+
+	p = format_unsigned(end, num);
+	write_all(STDERR_FILENO, p, end - p);
+}
+
+static uintptr_t fault_pc(void *ucontext)
+{
+	ucontext_t *uc = ucontext;
+
+#if defined(__x86_64__)
+	return uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+	return uc->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+	return uc->uc_mcontext.pc;
+#else
+	(void) uc;
+	return 0;
+#endif
+}
+
+/* the lambda whose code starts closest below pc, or -1. Lambdas that were
+   inlined into others are attributed to their caller. */
+static int64_t find_lambda(uintptr_t pc)
+{
+	uintptr_t best = 0, addr;
+	int64_t id = -1;
+	uint32_t i;
+
+	for (i = 0; i < stack_n_lambdas; i++) {
+		addr = (uintptr_t) stack_lambdas[i];
+		if (addr <= pc && addr >= best) {
+			best = addr;
+			id = i;
+		}
+	}
+
+	return id;
+}
+
+static void segv_handler(int sig, siginfo_t *info, void *ucontext)
+{
+	unsigned char *addr = info->si_addr;
+	const char *what;
+	int64_t id;
+
+	(void) sig;
+
+	if (addr >= stack_region && addr < stack_region + GUARD_SIZE) {
+		what = "underflow";
+	} else if (addr >= stack_region + stack_region_size - GUARD_SIZE &&
+			addr < stack_region + stack_region_size) {
+		what = "overflow";
+	} else {
+		/* not ours, let it crash the usual way */
+		signal(SIGSEGV, SIG_DFL);
+		return;
+	}
+
+	/* the fault happened in generated code, not in the middle of put_bytes,
+	   so the output buffer is consistent */
+	flush_output();
+
+	put_error("libfalse: stack ");
+	put_error(what);
+
+	id = find_lambda(fault_pc(ucontext));
+	if (id >= 0) {
+		put_error(" in lambda ");
+		put_error_num(id);
+		put_error(" (line ");
+		put_error_num(stack_lambda_pos[2 * id]);
+		put_error(", column ");
+		put_error_num(stack_lambda_pos[2 * id + 1]);
+		put_error(")");
+	}
+	put_error("\n");
+	_exit(EXIT_FAILURE);
+}
+
+uint32_t *lf_stack_init(uint32_t size, void (*const *lambdas)(void),
+		const uint32_t *lambda_pos, uint32_t n_lambdas)
+{
+	static const char msg[] = "libfalse: can't allocate the stack\n";
+	size_t page = sysconf(_SC_PAGESIZE), usable;
+	struct sigaction sa;
+
+	/* stack[0] is never used (stack_index 0 means "empty"), and stack[1]
+	   is the first element, so we need size + 1 elements. Underflows are
+	   caught exactly, overflows only after the last page. */
+	usable = ((size_t) size + 1) * sizeof(uint32_t);
+	usable = (usable + page - 1) / page * page;
+	stack_region_size = GUARD_SIZE + usable + GUARD_SIZE;
+
+	/* reserve the whole region, but only make the middle accessible; the
+	   kernel commits the pages when they're first touched */
+	stack_region = mmap(NULL, stack_region_size, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (stack_region == MAP_FAILED ||
+	    mprotect(stack_region + GUARD_SIZE, usable, PROT_READ | PROT_WRITE)) {
+		write_all(STDERR_FILENO, msg, sizeof(msg) - 1);
+		exit(EXIT_FAILURE);
+	}
+
+	stack_lambdas = lambdas;
+	stack_lambda_pos = lambda_pos;
+	stack_n_lambdas = n_lambdas;
+
+	setup_altstack();
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = segv_handler;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, NULL);
+
+	/* make stack[0] the last element of the lower guard */
+	return (uint32_t *) (stack_region + GUARD_SIZE) - 1;
+}
+
+/*
+ * Find the values that come up most often, approximately: A value that
+ * isn't in the slots takes a free one, and if there is none, all counts are
+ * decremented instead. Values that make up more than a fifth of the calls
+ * stay in the slots, but their counts may be too low.
+ */
+void lf_profile_value(uint64_t *slots, uint32_t value)
+{
+	uint64_t *free_slot = NULL;
+	int i;
+
+	for (i = 0; i < LF_PROFILE_VALUES; i++) {
+		if (slots[2 * i] == (uint64_t) value + 1) {
+			slots[2 * i + 1]++;
+			return;
+		}
+		if (!slots[2 * i + 1] && !free_slot)
+			free_slot = &slots[2 * i];
+	}
+
+	if (free_slot) {
+		free_slot[0] = (uint64_t) value + 1;
+		free_slot[1] = 1;
+		return;
+	}
+	for (i = 0; i < LF_PROFILE_VALUES; i++)
+		slots[2 * i + 1]--;
+}
+
+/* each line of keys is 'n', 'c' or 'v' and the name of a counter; counts
+   go to $LLFALSE_PROFILE (false.prof by default) and cycles to the same file
+   with ".cycles" appended, one "name value" line for each counter that isn't
+   0. 'v' counters are the slots of lf_profile_value(), and each lambda in
+   them gets a line "name;lambda_ID count". */
+void lf_profile_write(const uint64_t *counters, const char *keys, uint32_t n)
+{
+	const char *name = getenv("LLFALSE_PROFILE");
+	char *cycles_name;
+	FILE *fp[2] = { NULL, NULL }, *f;
+	const char *end;
+	uint32_t i, j, size;
+
+	if (!name || !*name)
+		name = "false.prof";
+	cycles_name = malloc(strlen(name) + sizeof(".cycles"));
+	if (!cycles_name)
+		return;
+	strcpy(cycles_name, name);
+	strcat(cycles_name, ".cycles");
+
+	for (i = 0; i < n; i += size, keys = end + 1) {
+		end = strchr(keys, '\n');
+		size = *keys == 'v'? 2 * LF_PROFILE_VALUES : 1;
+		for (j = 0; j < size; j++)
+			if (counters[i + j])
+				break;
+		if (j == size)
+			continue;
+
+		f = fp[*keys == 'c'];
+		if (!f) {
+			f = fopen(*keys == 'c'? cycles_name : name, "w");
+			if (!f) {
+				put_error("libfalse: can't write the profile\n");
+				break;
+			}
+			fp[*keys == 'c'] = f;
+		}
+		if (*keys != 'v') {
+			fprintf(f, "%.*s %llu\n", (int) (end - keys - 1),
+					keys + 1, (unsigned long long) counters[i]);
+			continue;
+		}
+		for (j = 0; j < size; j += 2)
+			if (counters[i + j + 1])
+				fprintf(f, "%.*s;lambda_%llu %llu\n",
+						(int) (end - keys - 1), keys + 1,
+						(unsigned long long) counters[i + j] - 1,
+						(unsigned long long) counters[i + j + 1]);
+	}
+
+	for (i = 0; i < 2; i++)
+		if (fp[i] && fclose(fp[i]))
+			put_error("libfalse: can't write the profile\n");
+	free(cycles_name);
 }
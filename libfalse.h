@@ -0,0 +1,36 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2012-2013  Jonathan Neuschäfer <j.neuschaefer@gmx.net>
+ *
+ * libfalse - the llfalse helper library
+ *
+ * These are the functions that the code generated by llfalse calls.
+ */
+
+#include <stdint.h>
+
+void lf_printnum(uint32_t num);
+void lf_printunum(uint32_t num);
+void lf_printstring(const char *str);
+void lf_putchar(uint32_t ch);
+uint32_t lf_getchar(void);
+void lf_flush(void);
+
+/* run fn on a new thread with a stack of stack_size bytes, and wait for it */
+void lf_run(void (*fn)(void), uint64_t stack_size);
+
+/* set up the False stack with room for size elements and return a pointer
+   to it. lambdas and lambda_pos (line and column of each lambda) are used
+   to report where stack overflows and underflows happen. */
+uint32_t *lf_stack_init(uint32_t size, void (*const *lambdas)(void),
+		const uint32_t *lambda_pos, uint32_t n_lambdas);
+
+/* the number of values that lf_profile_value() keeps track of */
+#define LF_PROFILE_VALUES 4
+
+/* count value in slots, LF_PROFILE_VALUES pairs of value + 1 and count */
+void lf_profile_value(uint64_t *slots, uint32_t value);
+
+/* write the profile counters of a program compiled with --profile, see
+   prepare_profile() in llfalse.c */
+void lf_profile_write(const uint64_t *counters, const char *keys, uint32_t n);
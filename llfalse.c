@@ -17,37 +17,348 @@
 #include <errno.h>
 #include <ctype.h>
 #include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <link.h> /* for dl_iterate_phdr */
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
 
 #include "util.h"
+#include "libfalse.h"
 
 #include <llvm-c/Core.h>
 #include <llvm-c/BitWriter.h>
+#include <llvm-c/BitReader.h>
+#include <llvm-c/Linker.h>
 #include <llvm-c/Analysis.h> /* for LLVMVerifyModule */
+#include <llvm-c/DebugInfo.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/OrcEE.h>
+#include <llvm-c/ExecutionEngine.h> /* for the JIT event listeners */
+#include <llvm/Config/llvm-config.h> /* for LLVM_VERSION_MAJOR */
 
 
-/* The maximum number of items the false stack. */
-#define DEFAULT_STACKSIZE 1024 /* 4kB */
+/* The maximum number of items on the false stack. It's only reserved address
+   space, libfalse's lf_stack_init() lets the pages be committed on demand. */
+#define DEFAULT_STACKSIZE (1024 * 1024) /* 4MB */
+#define MAX_STACKSIZE (1U << 30)
+
+/* --tiered compiles lambdas once they are called this often */
+#define DEFAULT_TIER_THRESHOLD 1000
+
+/* the number of instructions that may be inlined into one function, see
+   gen_body() */
+#define MAX_INLINE_SIZE 2000
+
+enum report_format {
+	REPORT_NONE,
+	REPORT_TEXT,
+	REPORT_JSON,
+};
+
+enum profile_mode {
+	PROFILE_NONE,
+	PROFILE_COUNTS,	/* how often lambdas, branches and loops run */
+	PROFILE_CYCLES,	/* and how many cycles each lambda takes */
+};
+
+enum emit_type {
+	EMIT_BITCODE,
+	EMIT_IR,
+	EMIT_ASM,
+	EMIT_OBJ,
+	EMIT_EXE,
+};
 
 /* options */
 static struct {
 	bool decode_latin1;
 	bool decode_utf8;
 	bool unsigned_mode;
-	unsigned int stack_size;
+	unsigned int stack_size; /* 0: as much as the program needs */
+	bool report_effects;
+	bool debug_info; /* -g */
+	enum report_format time_report;
+	enum profile_mode profile;
+	const char *profile_use; /* the profile to optimize for */
+	uint64_t native_stack; /* run the program on a thread with this stack */
+	unsigned int jobs; /* code generation threads; 0: one per CPU */
 	unsigned int int_width;
+	char opt_level; /* '0' to '3', or 's' */
+	enum emit_type emit;
+	bool run; /* JIT-compile and run the program instead of emitting it */
+	bool perf; /* write a perf jitdump file for the JIT */
+	bool interpret; /* run the program without compiling it */
+	uint32_t tiered; /* compile lambdas used this often, see tier_count() */
+	const char *infile, *outfile;
+	const char *triple, *cpu, *features;
+	const char *libdir; /* where libfalse lives, for EMIT_EXE */
+	const char *runtime; /* libfalse bitcode to link into the module */
+	const char *cache_dir;
+	bool static_runtime;
 } options = {
 	.decode_latin1 = true,
 	.decode_utf8 = true,
 	.unsigned_mode = false,
-	.stack_size = DEFAULT_STACKSIZE,
-	.int_width = sizeof(int) * CHAR_BIT /* FIXME */
+	.int_width = sizeof(int) * CHAR_BIT, /* FIXME */
+	.opt_level = '0',
+	.emit = EMIT_BITCODE,
+};
+
+static const char *const emit_names[] = {
+	[EMIT_BITCODE] = "bc",
+	[EMIT_IR] = "ll",
+	[EMIT_ASM] = "asm",
+	[EMIT_OBJ] = "obj",
+	[EMIT_EXE] = "exe",
 };
 
+static void usage(FILE *fp, const char *argv0)
+{
+	fprintf(fp,
+"Usage: %s [options] [in_file.f] >out_file.bc\n"
+"       %s [options] --run [in_file.f]\n"
+"\n"
+"Options:\n"
+"  -O0, -O1, -O2, -O3, -Os   optimization level (default: -O0)\n"
+"  -o FILE                   write output to FILE (default: stdout, or a.out)\n"
+"  --emit=TYPE               output type: bc (default), ll, asm, obj, or exe\n"
+"  --target=TRIPLE           generate code for TRIPLE (default: host)\n"
+"  -mcpu=CPU                 tune for CPU; 'native' selects the host CPU\n"
+"  -mattr=FEATURES           enable/disable target features (+foo,-bar)\n"
+"  -L DIR                    look for libfalse in DIR when linking\n"
+"  --static-runtime          link libfalse statically (libfalse.a)\n"
+"  --runtime=FILE.bc         link libfalse's bitcode into the program, so that\n"
+"                            the runtime functions can be inlined\n"
+"  --unsigned                treat numbers as unsigned in /, > and .\n"
+"  --stack-size=N            room for (at least) N items on the False stack\n"
+"                            (default: what the program needs, if that can\n"
+"                            be determined, or 1M; K, M, G suffixes are\n"
+"                            allowed)\n"
+"  -g                        generate debug info that maps the code back\n"
+"                            to the False source\n"
+"  --stack-effects           report the stack effect of each lambda\n"
+"  --time-report[=FORMAT]    report the time and memory each phase of the\n"
+"                            compilation takes, as text (default) or json\n"
+"  --profile[=cycles]        count how often each lambda, '?' and '#' runs,\n"
+"                            and optionally the cycles spent in each lambda;\n"
+"                            the counts are written to $LLFALSE_PROFILE\n"
+"                            (default: false.prof) at exit\n"
+"  --profile-use=FILE        optimize for the counts in FILE, which a program\n"
+"                            compiled with --profile wrote\n"
+"  --native-stack=SIZE       run the program on a thread with a SIZE byte\n"
+"                            native stack, for deep recursion (K, M, G\n"
+"                            suffixes are allowed)\n"
+"  --run                     compile the program in memory and run it\n"
+"  --interpret               run the program in an interpreter, which starts\n"
+"                            much faster than --run, but runs slower\n"
+"  --tiered[=N]              interpret the program, and compile the lambdas\n"
+"                            that are called N times (default: 1000) in the\n"
+"                            background\n"
+"  --perf                    with --run or --tiered, write a jitdump file\n"
+"                            for 'perf inject --jit' to $JITDUMPDIR/.debug/jit\n"
+"                            (default: $HOME/.debug/jit); implies -g\n"
+"  --cache=DIR               keep the output in DIR and reuse it when the\n"
+"                            program and options are the same (default:\n"
+"                            $LLFALSE_CACHE, if set)\n"
+"  -j N                      optimize and generate code on N threads (default:\n"
+"                            one per CPU, if the program is big); only for\n"
+"                            obj and exe output and --run\n"
+"  -h, --help                show this help\n"
+"\n"
+"If no input file is given, the program is read from stdin.\n", argv0, argv0);
+}
+
+static void bad_usage(const char *argv0, const char *fmt, const char *arg)
+{
+	fprintf(stderr, "%s: ", argv0);
+	fprintf(stderr, fmt, arg);
+	fputc('\n', stderr);
+	usage(stderr, argv0);
+	exit(EXIT_FAILURE);
+}
+
+/* match "--name=value" style options; returns the value or NULL */
+static const char *option_value(const char *arg, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strncmp(arg, name, len) || arg[len] != '=')
+		return NULL;
+	return arg + len + 1;
+}
+
+/* parse a size like "512M"; returns 0 if it's not valid */
+static uint64_t parse_size(const char *str)
+{
+	unsigned long long size;
+	uint64_t unit = 1;
+	char *end;
+
+	/* strtoull() would happily negate "-1" */
+	if (!isdigit((unsigned char)*str))
+		return 0;
+
+	errno = 0;
+	size = strtoull(str, &end, 0);
+	if (errno || end == str)
+		return 0;
+
+	switch (*end) {
+	case 'G': case 'g':
+		unit *= 1024; /* fall through */
+	case 'M': case 'm':
+		unit *= 1024; /* fall through */
+	case 'K': case 'k':
+		unit *= 1024;
+		end++;
+	}
+
+	if (*end || size > UINT64_MAX / unit)
+		return 0;
+	return size * unit;
+}
+
 static void parse_cmdline(int argc, char **argv)
 {
-	(void)argc;
-	(void)argv;
-	/* nop */
+	const char *value;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+			usage(stdout, argv[0]);
+			exit(EXIT_SUCCESS);
+		} else if (!strncmp(arg, "-O", 2) && strlen(arg) == 3 &&
+				strchr("0123s", arg[2])) {
+			options.opt_level = arg[2];
+		} else if (!strcmp(arg, "-o") || !strcmp(arg, "-L")) {
+			if (++i == argc)
+				bad_usage(argv[0], "option '%s' needs an argument", arg);
+			if (arg[1] == 'o')
+				options.outfile = argv[i];
+			else
+				options.libdir = argv[i];
+		} else if (!strcmp(arg, "-g")) {
+			options.debug_info = true;
+		} else if (!strcmp(arg, "--static-runtime")) {
+			options.static_runtime = true;
+		} else if ((value = option_value(arg, "--runtime"))) {
+			options.runtime = value;
+		} else if (!strcmp(arg, "--unsigned")) {
+			options.unsigned_mode = true;
+		} else if ((value = option_value(arg, "--stack-size"))) {
+			uint64_t size = parse_size(value);
+
+			if (!size || size > MAX_STACKSIZE)
+				bad_usage(argv[0], "invalid stack size '%s'", value);
+			options.stack_size = size;
+		} else if (!strcmp(arg, "--stack-effects")) {
+			options.report_effects = true;
+		} else if (!strcmp(arg, "--time-report")) {
+			options.time_report = REPORT_TEXT;
+		} else if ((value = option_value(arg, "--time-report"))) {
+			if (!strcmp(value, "text"))
+				options.time_report = REPORT_TEXT;
+			else if (!strcmp(value, "json"))
+				options.time_report = REPORT_JSON;
+			else
+				bad_usage(argv[0], "unknown report format '%s'", value);
+		} else if (!strcmp(arg, "--profile")) {
+			options.profile = PROFILE_COUNTS;
+		} else if ((value = option_value(arg, "--profile"))) {
+			if (strcmp(value, "cycles"))
+				bad_usage(argv[0], "unknown profile type '%s'", value);
+			options.profile = PROFILE_CYCLES;
+		} else if ((value = option_value(arg, "--profile-use"))) {
+			options.profile_use = value;
+		} else if ((value = option_value(arg, "--native-stack"))) {
+			options.native_stack = parse_size(value);
+			if (!options.native_stack)
+				bad_usage(argv[0], "invalid stack size '%s'", value);
+		} else if (!strcmp(arg, "--run")) {
+			options.run = true;
+		} else if (!strcmp(arg, "--interpret")) {
+			options.interpret = true;
+		} else if (!strcmp(arg, "--tiered")) {
+			options.interpret = true;
+			options.tiered = DEFAULT_TIER_THRESHOLD;
+		} else if ((value = option_value(arg, "--tiered"))) {
+			char *end;
+
+			options.interpret = true;
+			options.tiered = strtoul(value, &end, 10);
+			if (*end || !options.tiered)
+				bad_usage(argv[0], "invalid call count '%s'", value);
+		} else if (!strcmp(arg, "--perf")) {
+			options.perf = true;
+			options.debug_info = true;
+		} else if (!strncmp(arg, "-j", 2)) {
+			const char *jobs = arg + 2;
+			char *end;
+
+			if (!*jobs) {
+				if (++i == argc)
+					bad_usage(argv[0], "option '%s' needs an argument", arg);
+				jobs = argv[i];
+			}
+			options.jobs = strtoul(jobs, &end, 10);
+			if (*end || !options.jobs)
+				bad_usage(argv[0], "invalid number of jobs '%s'", jobs);
+		} else if ((value = option_value(arg, "--cache"))) {
+			options.cache_dir = value;
+		} else if ((value = option_value(arg, "--emit"))) {
+			unsigned int t;
+
+			for (t = 0; t < sizeof(emit_names) / sizeof(*emit_names); t++)
+				if (!strcmp(value, emit_names[t]))
+					break;
+			if (t == sizeof(emit_names) / sizeof(*emit_names))
+				bad_usage(argv[0], "unknown output type '%s'", value);
+			options.emit = t;
+		} else if ((value = option_value(arg, "--target"))) {
+			options.triple = value;
+		} else if ((value = option_value(arg, "-mcpu"))) {
+			options.cpu = value;
+		} else if ((value = option_value(arg, "-mattr"))) {
+			options.features = value;
+		} else if (arg[0] != '-' || !strcmp(arg, "-")) {
+			if (options.infile)
+				bad_usage(argv[0], "more than one input file given ('%s')", arg);
+			options.infile = strcmp(arg, "-")? arg : NULL;
+		} else {
+			bad_usage(argv[0], "unknown option '%s'", arg);
+		}
+	}
+
+	if (options.perf && !options.run && !options.tiered)
+		bad_usage(argv[0], "option '%s' only works with --run or --tiered",
+				"--perf");
+	/* --tiered has no main that writes the profile, and the compiled
+	   code uses the runtime that is linked into llfalse */
+	if (options.tiered && options.profile)
+		bad_usage(argv[0], "option '%s' doesn't work with --tiered",
+				"--profile");
+	if (options.tiered && options.runtime)
+		bad_usage(argv[0], "option '%s' doesn't work with --tiered",
+				"--runtime");
+
+	/* by default, look for libfalse next to llfalse, like falsec.sh does */
+	if (!options.libdir && strchr(argv[0], '/')) {
+		char *dir = xmalloc(strlen(argv[0]) + 1);
+
+		strcpy(dir, argv[0]);
+		*strrchr(dir, '/') = '\0';
+		options.libdir = dir;
+	}
 }
 
 
@@ -63,33 +374,177 @@ static void set_linkage(LLVMValueRef v, enum linkage lk)
 	switch (lk) {
 	case LINKAGE_DATA:
 	case LINKAGE_CONST_DATA:
-	case LINKAGE_CODE:
 		LLVMSetLinkage(v, LLVMPrivateLinkage);
 		break;
+	case LINKAGE_CODE:
+		/* private functions don't get a symbol, which debuggers and
+		   profilers need for their names */
+		LLVMSetLinkage(v, options.debug_info? LLVMInternalLinkage :
+				LLVMPrivateLinkage);
+		break;
 	}
 }
 
+/* an element of the virtual stack, see get_sp() */
+struct stack_value {
+	LLVMValueRef value;
+	struct lambda *lambda;	/* the lambda whose id this is, if known */
+	int var;		/* the variable this was loaded from, or -1 */
+};
+
+/* a snapshot of the code generation state of the stack */
+struct stack_state {
+	LLVMValueRef sp;
+	bool sp_dirty;
+	struct stack_value *vs;
+	unsigned int vs_len;
+};
+
+/*
+ * The parsed program: Each lambda's body is a sequence of instructions, most
+ * of which correspond directly to a False command. The opcodes are the
+ * characters of these commands.
+ */
+enum opcode {
+	OP_PUSH = 'n',		/* push u.value */
+	OP_LAMBDA = '[',	/* push the id of u.lambda */
+	OP_STRING = '"',	/* print u.str */
+	OP_STORE = ':',
+	OP_LOAD = ';',
+	OP_CALL = '!',
+	OP_ADD = '+',
+	OP_SUB = '-',
+	OP_MUL = '*',
+	OP_DIV = '/',
+	OP_AND = '&',
+	OP_OR = '|',
+	OP_EQ = '=',
+	OP_GT = '>',
+	OP_NEG = '_',
+	OP_NOT = '~',
+	OP_DUP = '$',
+	OP_DROP = '%',
+	OP_SWAP = '\\',
+	OP_ROT = '@',
+	OP_PICK = 'O',
+	OP_IF = '?',
+	OP_WHILE = '#',
+	OP_PRINTNUM = '.',
+	OP_PUTC = ',',
+	OP_GETC = '^',
+	OP_FLUSH = 'B',
+
+	/* combined instructions, see peephole() */
+	OP_ADD_CONST = 'A',	/* add u.value to the top element */
+	OP_LOAD_VAR = 'L',	/* push variable u.value */
+	OP_STORE_VAR = 'S',	/* pop into variable u.value */
+	OP_PICK_CONST = 'P',	/* copy element u.value (see 'O') */
+};
+
+struct insn {
+	enum opcode op;
+	size_t offset;		/* in the source code */
+	unsigned int line, column; /* see locate_code() */
+	union {
+		uint32_t value;
+		struct lambda *lambda;
+		struct {
+			char *text;
+			size_t len;
+			LLVMValueRef global; /* created on first use */
+		} str;
+		struct {
+			struct lambda *lambda;	/* that it's in */
+			uint32_t counter;	/* see prepare_profile() */
+		} site;			/* '?', '#' and '!' */
+	} u;
+};
+
+/* the result of analyze_lambda() */
+struct stack_effect {
+	enum {
+		EFFECT_UNKNOWN,	/* not analyzed yet */
+		EFFECT_BUSY,	/* being analyzed */
+		EFFECT_FIXED,
+		EFFECT_DYNAMIC,
+	} state;
+	unsigned int pops, pushes, max_depth;
+	const char *dynamic; /* why the effect is dynamic */
+};
+
 /* lambdas are basically anonymous functions */
 struct environment;
 struct lambda {
-	uint32_t id;
-	struct lambda *prev;	/* linked list */
+	uint32_t id;		/* the index in env->lambdas */
 	struct environment *env;
 
+	size_t start;	/* the offset of the lambda in the source code */
+
+	/* the body */
+	struct insn *code;
+	unsigned int n_code, code_size;
+
+	struct stack_effect effect;
+
+	/* its position, see locate_code(), and the first of its profile
+	   counters, see prepare_profile() */
 	unsigned int line, column;
+	uint32_t profile_base;
 
 	/* the number of BBs allocated so far */
 	unsigned int n_bb;
 
 	LLVMValueRef fn;
-	LLVMBasicBlockRef bb;	/* always valid */
-	LLVMBuilderRef builder;
+	LLVMBuilderRef builder;	/* only valid during code generation */
+	LLVMValueRef stack;	/* the stack base, loaded on entry */
+	LLVMValueRef start_cycles;	/* --profile=cycles, loaded on entry */
+	bool tail;		/* the current instruction is the last one that
+				   the function runs, see build_if() */
+	bool inlining;		/* its code is being generated, see gen_body() */
+	unsigned int inline_size;	/* instructions inlined so far */
+
+	/* code generation state of the stack, see get_sp() */
+	LLVMValueRef sp;
+	bool sp_dirty;
+	struct stack_value *vs;
+	unsigned int vs_len, vs_size;
+
+	/* variables that are known to hold a lambda or value at the current
+	   point */
+	struct lambda *var_lambda[26];
+	LLVMValueRef var_value[26];
+};
+
+/* a line of the --profile-use file, see load_profile() */
+struct profile_entry {
+	char *name;
+	uint64_t count;
+	bool used;	/* by something in the program */
 };
 
 struct environment {
-	FILE *fp;
 	const char *file;
-	struct lambda *last_lambda;
+
+	/* the source code, see read_source() */
+	const unsigned char *src;
+	size_t src_len, src_pos;
+	size_t cmd_pos;	/* where the command being parsed starts */
+	bool src_mapped;
+
+	/* where source_position() stopped */
+	size_t pos_offset;
+	unsigned int pos_line, pos_column;
+
+	struct arena arena;	/* for everything the front end allocates */
+
+	/* all lambdas, in source order; lambda 0 is the main program */
+	struct lambda **lambdas;
+	unsigned int n_lambdas, lambdas_size;
+
+	/* shared by the code generation functions */
+	LLVMBuilderRef builder;
+	struct stack_value *vs;	/* see gen_lambda() */
+	unsigned int vs_size;
 	unsigned int string_id;
 
 	LLVMModuleRef module;
@@ -97,9 +552,50 @@ struct environment {
 
 	LLVMValueRef func_main, func_lambda_0;
 
-	LLVMValueRef func_printnum, func_printstring, func_putchar,
-		     func_getchar, func_flush;
-	LLVMValueRef var_vars, var_stack, var_stackidx, var_lambdas;
+	LLVMValueRef func_printnum, func_printunum, func_printstring, func_putchar,
+		     func_getchar, func_flush, func_run, func_stack_init;
+	LLVMValueRef var_stack, var_stackidx, var_lambdas, var_lambda_pos;
+	LLVMValueRef func_tier_call;	/* --tiered, see tier_call() */
+
+	/* --profile, see prepare_profile() */
+	LLVMValueRef var_profile, profile_keys;
+	LLVMValueRef func_profile_write, func_profile_value;
+	LLVMValueRef func_readcyclecounter;
+	uint32_t n_profile;
+
+	/* -g, see prepare_debug_info() */
+	LLVMDIBuilderRef dibuilder;
+	LLVMMetadataRef di_file, di_lambda_type;
+
+	/* --profile-use, sorted by name, see load_profile() */
+	struct profile_entry *profile;
+	unsigned int n_profile_entries;
+	uint64_t profile_hot;	/* lambdas that run this often are hot */
+
+	/*
+	 * Each variable is a global of its own, so that LLVM knows that stores
+	 * to one don't affect the others. Only references that aren't
+	 * constant go through the load_var and store_var functions, see
+	 * build_var_accessors().
+	 */
+	LLVMValueRef var_var[26];
+	LLVMValueRef func_load_var, func_store_var;
+
+	/*
+	 * What is known about the lambdas stored in variables, program-wide:
+	 * stored_lambda[v] is the only lambda that has ever been stored in
+	 * variable v, unless var_clobbered[v] is set. dynamic_store is set if
+	 * any store to a computed variable reference exists. call_var[v] is
+	 * the function used to call the lambda in variable v, see
+	 * build_var_dispatchers().
+	 */
+	struct lambda *stored_lambda[26];
+	bool var_clobbered[26];
+	bool dynamic_store;
+	LLVMValueRef call_var[26];
+
+	/* like stored_lambda, but found before code generation */
+	struct lambda *effect_var_lambda[26];
 };
 
 static void l_init_llvm(struct lambda *l, const char *name)
@@ -109,43 +605,38 @@ static void l_init_llvm(struct lambda *l, const char *name)
 	/* Set private linkage to allow better optimization */
 	set_linkage(l->fn, LINKAGE_CODE);
 
-	l->bb = LLVMAppendBasicBlock(l->fn, "");
-	l->n_bb = 1;
-	l->builder = LLVMCreateBuilder();
-	LLVMPositionBuilderAtEnd(l->builder, l->bb);
+	l->builder = NULL;
+	l->vs = NULL;
+	l->vs_len = l->vs_size = 0;
 }
 
-/* allocate a new lambda and add it to the linked list */
-static struct lambda *l_new_child(struct lambda *parent)
+/* allocate a new lambda, starting at offset start of the source code, and
+   add it to env->lambdas */
+static struct lambda *l_new(struct environment *env, size_t start)
 {
 	char buffer[sizeof("lambda_4000000000")];
+	struct lambda *new_l;
 
-	struct lambda *new_l = xmalloc(sizeof(*new_l));
-	new_l->id = parent->env->last_lambda->id + 1;
-	new_l->prev = parent->env->last_lambda;
-	parent->env->last_lambda = new_l;
-	new_l->env = parent->env;
-	new_l->line = parent->line;
-	new_l->column = parent->column;
-
-	snprintf(buffer, sizeof(buffer), "lambda_%lu", (unsigned long) new_l->id);
-	l_init_llvm(new_l, buffer);
-
-	return new_l;
-}
-
-/* allocate the first lambda */
-static struct lambda *l_new(struct environment *env)
-{
-	struct lambda *new_l = xmalloc(sizeof(*new_l));
-	new_l->id = 0;
-	new_l->prev = NULL;
-	env->last_lambda = new_l;
+	new_l = arena_alloc(&env->arena, sizeof(*new_l));
+	memset(new_l, 0, sizeof(*new_l));
+	new_l->id = env->n_lambdas;
 	new_l->env = env;
-	new_l->line = 1;
-	new_l->column = 0;
+	new_l->start = start;
+	new_l->effect.state = EFFECT_UNKNOWN;
+
+	if (env->n_lambdas == env->lambdas_size) {
+		env->lambdas_size = env->lambdas_size? 2 * env->lambdas_size : 64;
+		env->lambdas = xrealloc(env->lambdas,
+				env->lambdas_size * sizeof(*env->lambdas));
+	}
+	env->lambdas[env->n_lambdas++] = new_l;
 
-	l_init_llvm(new_l, "lambda_0");
+	/* --interpret doesn't need LLVM */
+	if (env->module) {
+		snprintf(buffer, sizeof(buffer), "lambda_%lu",
+				(unsigned long) new_l->id);
+		l_init_llvm(new_l, buffer);
+	}
 
 	return new_l;
 }
@@ -161,21 +652,54 @@ static LLVMBasicBlockRef l_new_bb(struct lambda *l)
 
 static int l_getchar(struct lambda *l)
 {
-	int ch = getc(l->env->fp);
-	if (ch == '\n') {
-		l->line++;
-		l->column = 0;
-	} else {
-		l->column++;
+	struct environment *env = l->env;
+
+	if (env->src_pos == env->src_len)
+		return EOF;
+	return env->src[env->src_pos++];
+}
+
+/*
+ * Find the line and column of the byte at offset in the source code. Lines
+ * and columns aren't tracked while parsing, they are only needed for
+ * messages. Consecutive calls with increasing offsets continue where the
+ * last one stopped.
+ */
+static void source_position(struct environment *env, size_t offset,
+		unsigned int *line, unsigned int *column)
+{
+	size_t i;
+
+	if (offset < env->pos_offset) {
+		env->pos_offset = 0;
+		env->pos_line = 1;
+		env->pos_column = 0;
+	}
+
+	for (i = env->pos_offset; i < offset && i < env->src_len; i++) {
+		if (env->src[i] == '\n') {
+			env->pos_line++;
+			env->pos_column = 0;
+		} else if (!options.decode_utf8 || (env->src[i] & 0xc0) != 0x80) {
+			/* UTF-8 continuation bytes don't count */
+			env->pos_column++;
+		}
 	}
+	env->pos_offset = offset;
 
-	return ch;
+	*line = env->pos_line;
+	*column = env->pos_column + 1;
 }
 
 static void l_vmessage(struct lambda *l, const char *pre,
 		const char *fmt, va_list ap)
 {
-	fprintf(stderr, "%s:%u:%u: %s", l->env->file, l->line, l->column, pre);
+	struct environment *env = l->env;
+	unsigned int line, column;
+
+	/* the position of the last character that was read */
+	source_position(env, env->src_pos? env->src_pos - 1 : 0, &line, &column);
+	fprintf(stderr, "%s:%u:%u: %s", env->file, line, column, pre);
 	vfprintf(stderr, fmt, ap);
 	fputc('\n', stderr);
 }
@@ -207,116 +731,483 @@ static LLVMValueRef u32_value(uint32_t n)
 	return n? LLVMConstInt(i32t, n, false) : LLVMConstNull(i32t);
 }
 
-/* returns a pointer (value) to the requested stack element.
+/* LLVMBuildCall2() for calls of functions, whose type LLVM knows */
+static LLVMValueRef build_fn_call(LLVMBuilderRef b, LLVMValueRef fn,
+		LLVMValueRef *args, unsigned int n, const char *name)
+{
+	return LLVMBuildCall2(b, LLVMGlobalGetValueType(fn), fn, args, n, name);
+}
+
+/* LLVMBuildLoad2() for loads from global variables */
+static LLVMValueRef build_load_global(LLVMBuilderRef b, LLVMValueRef global,
+		const char *name)
+{
+	return LLVMBuildLoad2(b, LLVMGlobalGetValueType(global), global, name);
+}
+
+/*
+ * While the code of a lambda is generated, the False stack is split into two
+ * parts: The global stack array, whose top element is at index l->sp, and the
+ * virtual stack (l->vs), which holds the values that have been pushed but not
+ * yet written back to memory. l->sp is an SSA value, or NULL if it has to be
+ * (re)loaded from stack_index first.
+ *
+ * The global state is only brought up to date (spilled) where other code may
+ * look at it: before calls, before picks with a dynamic index, and before
+ * returning.
+ */
+
+static LLVMValueRef get_sp(struct lambda *l)
+{
+	if (!l->sp) {
+		l->sp = build_load_global(l->builder, l->env->var_stackidx,
+				"sp");
+		l->sp_dirty = false;
+	}
+	return l->sp;
+}
+
+static void set_sp(struct lambda *l, LLVMValueRef sp)
+{
+	l->sp = sp;
+	l->sp_dirty = true;
+}
+
+/* forget what we know about the variables, e.g. where control flow merges */
+static void forget_vars(struct lambda *l)
+{
+	memset(l->var_lambda, 0, sizeof(l->var_lambda));
+	memset(l->var_value, 0, sizeof(l->var_value));
+}
+
+/* forget everything we know about the global state, e.g. after a call */
+static void invalidate_sp(struct lambda *l)
+{
+	l->sp = NULL;
+	l->sp_dirty = false;
+	forget_vars(l);
+}
+
+/* returns a pointer (value) to the requested element of the global stack.
    0 selects the top element, 1 the element below the top etc. */
 static LLVMValueRef index_stack_by_value(struct lambda *l, LLVMValueRef i)
 {
-	LLVMValueRef indices[2], stackidx;
+	LLVMValueRef index;
 
-	stackidx = LLVMBuildLoad(l->builder, l->env->var_stackidx, "");
-	indices[0] = u32_value(0); /* We're accessing a global. */
-	indices[1] = LLVMBuildSub(l->builder, stackidx, i, "");
-	return LLVMBuildInBoundsGEP(l->builder, l->env->var_stack, indices, 2, "");
+	index = LLVMBuildSub(l->builder, get_sp(l), i, "");
+	return LLVMBuildInBoundsGEP2(l->builder, LLVMInt32Type(), l->stack,
+			&index, 1, "");
 }
 #define index_stack(l, i) index_stack_by_value((l), u32_value(i))
 
-static void store_stack(struct lambda *l, uint32_t index, LLVMValueRef value)
+static void reserve_vs(struct lambda *l)
 {
-	LLVMBuildStore(l->builder, value, index_stack(l, index));
+	if (l->vs_len == l->vs_size) {
+		l->vs_size = l->vs_size? 2 * l->vs_size : 16;
+		l->vs = xrealloc(l->vs, l->vs_size * sizeof(*l->vs));
+	}
 }
 
-static LLVMValueRef load_stack(struct lambda *l, uint32_t index)
+/* move the top element of the global stack to the bottom of the
+   virtual stack */
+static void pull_stack(struct lambda *l)
+{
+	LLVMValueRef value;
+
+	value = LLVMBuildLoad2(l->builder, LLVMInt32Type(),
+			index_stack(l, 0), "");
+	set_sp(l, LLVMBuildSub(l->builder, get_sp(l), u32_value(1), ""));
+
+	reserve_vs(l);
+	memmove(l->vs + 1, l->vs, l->vs_len * sizeof(*l->vs));
+	l->vs[0].value = value;
+	l->vs[0].lambda = NULL;
+	l->vs[0].var = -1;
+	l->vs_len++;
+}
+
+/* write the bottom elements of the virtual stack to the global stack, until
+   only n elements are left */
+static void shrink_vs(struct lambda *l, unsigned int n)
+{
+	unsigned int i, m = l->vs_len - n;
+
+	if (m == 0)
+		return;
+
+	/* the elements go above the current top, i.e. to negative indices */
+	for (i = 0; i < m; i++)
+		LLVMBuildStore(l->builder, l->vs[i].value,
+				index_stack(l, -(uint32_t)(i + 1)));
+
+	set_sp(l, LLVMBuildAdd(l->builder, get_sp(l), u32_value(m), ""));
+	memmove(l->vs, l->vs + m, n * sizeof(*l->vs));
+	l->vs_len = n;
+}
+
+/* write the virtual stack back to the global stack and update stack_index */
+static void spill_stack(struct lambda *l)
+{
+	if (l->vs_len == 0 && !l->sp_dirty)
+		return;
+
+	shrink_vs(l, 0);
+	LLVMBuildStore(l->builder, l->sp, l->env->var_stackidx);
+	l->sp_dirty = false;
+}
+
+static void save_stack(struct lambda *l, struct stack_state *st)
+{
+	st->sp = l->sp;
+	st->sp_dirty = l->sp_dirty;
+	st->vs_len = l->vs_len;
+	st->vs = xmalloc((l->vs_len + 1) * sizeof(*st->vs));
+	memcpy(st->vs, l->vs, l->vs_len * sizeof(*st->vs));
+}
+
+/* restore a snapshot made by save_stack and free it */
+static void restore_stack(struct lambda *l, struct stack_state *st)
 {
-	return LLVMBuildLoad(l->builder, index_stack(l, index), "");
+	l->sp = st->sp;
+	l->sp_dirty = st->sp_dirty;
+	l->vs_len = 0;
+	while (l->vs_len < st->vs_len) {
+		reserve_vs(l);
+		l->vs[l->vs_len] = st->vs[l->vs_len];
+		l->vs_len++;
+	}
+	free(st->vs);
+	st->vs = NULL;
 }
 
-/* positive deltas grow the stack, negative deltas shrink it */
-static void grow_stack(struct lambda *l, int delta)
+/*
+ * Join the stack states at the end of two basic blocks that both branch to
+ * the current one. Both states must have the same number of virtual stack
+ * elements and a valid sp; values that differ get a phi node.
+ */
+static void merge_stacks(struct lambda *l, struct stack_state *a,
+		LLVMBasicBlockRef a_bb, struct stack_state *b,
+		LLVMBasicBlockRef b_bb)
 {
-	LLVMValueRef old_size, new_size;
+	LLVMValueRef values[2];
+	LLVMBasicBlockRef blocks[2] = { a_bb, b_bb };
+	unsigned int i;
+
+	for (i = 0; i < a->vs_len; i++) {
+		if (a->vs[i].value == b->vs[i].value)
+			continue;
+		values[0] = a->vs[i].value;
+		values[1] = b->vs[i].value;
+		a->vs[i].value = LLVMBuildPhi(l->builder, LLVMInt32Type(), "");
+		LLVMAddIncoming(a->vs[i].value, values, blocks, 2);
+		a->vs[i].lambda = NULL;
+		a->vs[i].var = -1;
+	}
 
-	if (delta < 0) {
-		/* invalidate the newly free'd memory */
-		LLVMValueRef undef = LLVMGetUndef(LLVMInt32Type());
-		int i;
-		for (i = 0; i < -delta; i++)
-			LLVMBuildStore(l->builder, undef, index_stack(l, i));
+	if (a->sp != b->sp) {
+		values[0] = a->sp;
+		values[1] = b->sp;
+		a->sp = LLVMBuildPhi(l->builder, LLVMInt32Type(), "sp");
+		LLVMAddIncoming(a->sp, values, blocks, 2);
 	}
+	a->sp_dirty = a->sp_dirty || b->sp_dirty;
+
+	restore_stack(l, a);
+	free(b->vs);
+	b->vs = NULL;
+	forget_vars(l);
+}
+
+/* returns the requested element of the virtual stack, pulling it in from
+   the global stack if necessary */
+static struct stack_value *peek_stack(struct lambda *l, uint32_t index)
+{
+	while (l->vs_len <= index)
+		pull_stack(l);
+	return &l->vs[l->vs_len - 1 - index];
+}
+
+static void store_stack(struct lambda *l, uint32_t index, LLVMValueRef value)
+{
+	struct stack_value *sv = peek_stack(l, index);
+
+	sv->value = value;
+	sv->lambda = NULL;
+	sv->var = -1;
+}
+
+static LLVMValueRef load_stack(struct lambda *l, uint32_t index)
+{
+	return peek_stack(l, index)->value;
+}
 
-	old_size = LLVMBuildLoad(l->builder, l->env->var_stackidx, "");
-	new_size = LLVMBuildAdd(l->builder, old_size, u32_value(delta), "");
-	LLVMBuildStore(l->builder, new_size, l->env->var_stackidx);
+static void push_stack_value(struct lambda *l, struct stack_value sv)
+{
+	reserve_vs(l);
+	l->vs[l->vs_len++] = sv;
 }
 
 static void push_stack(struct lambda *l, LLVMValueRef value)
 {
-	grow_stack(l, 1);
-	store_stack(l, 0, value);
+	struct stack_value sv = { value, NULL, -1 };
+
+	push_stack_value(l, sv);
+}
+
+static struct stack_value pop_stack_value(struct lambda *l)
+{
+	if (l->vs_len == 0)
+		pull_stack(l);
+	return l->vs[--l->vs_len];
 }
 
 static LLVMValueRef pop_stack(struct lambda *l)
 {
-	LLVMValueRef ret;
+	return pop_stack_value(l).value;
+}
 
-	ret = load_stack(l, 0);
-	grow_stack(l, -1);
-	return ret;
+static void drop_stack(struct lambda *l)
+{
+	if (l->vs_len)
+		l->vs_len--;
+	else
+		set_sp(l, LLVMBuildSub(l->builder, get_sp(l), u32_value(1), ""));
 }
 
-static LLVMValueRef index_variables(struct lambda *l, LLVMValueRef ref)
+
+static int const_var_ref(LLVMValueRef ref);
+
+static LLVMValueRef load_var(struct lambda *l, LLVMValueRef ref)
 {
-	LLVMValueRef indices[2];
+	struct environment *env = l->env;
+	LLVMTypeRef i32t = LLVMInt32Type();
+	int var = const_var_ref(ref);
+
+	if (var < 0) {
+		if (!env->func_load_var) {
+			env->func_load_var = LLVMAddFunction(env->module,
+					"load_var", LLVMFunctionType(i32t,
+						&i32t, 1, false));
+			set_linkage(env->func_load_var, LINKAGE_CODE);
+		}
+		return build_fn_call(l->builder, env->func_load_var, &ref, 1, "");
+	}
 
-	indices[0] = u32_value(0);
-	indices[1] = ref;
-	return LLVMBuildInBoundsGEP(l->builder, l->env->var_vars, indices, 2, "");
+	/* the value stays valid until a call or a merge */
+	if (!l->var_value[var])
+		l->var_value[var] = build_load_global(l->builder,
+				env->var_var[var], "");
+	return l->var_value[var];
+}
+
+static void store_var(struct lambda *l, LLVMValueRef ref, LLVMValueRef value)
+{
+	struct environment *env = l->env;
+	LLVMTypeRef i32t = LLVMInt32Type(), parm[2] = { i32t, i32t };
+	LLVMValueRef args[2] = { ref, value };
+	int var = const_var_ref(ref);
+
+	if (var < 0) {
+		if (!env->func_store_var) {
+			env->func_store_var = LLVMAddFunction(env->module,
+					"store_var", LLVMFunctionType(
+						LLVMVoidType(), parm, 2, false));
+			set_linkage(env->func_store_var, LINKAGE_CODE);
+		}
+		build_fn_call(l->builder, env->func_store_var, args, 2, "");
+		forget_vars(l);
+		return;
+	}
+
+	LLVMBuildStore(l->builder, value, env->var_var[var]);
+	l->var_value[var] = value;
 }
 
-static LLVMValueRef load_lambdas(struct lambda *l, LLVMValueRef index)
+static LLVMValueRef load_lambdas(struct environment *env, LLVMBuilderRef b,
+		LLVMValueRef index)
 {
+	LLVMTypeRef ptr_type = LLVMPointerType(env->lambda_type, 0);
 	LLVMValueRef ptr, gep;
 
-	ptr = LLVMBuildLoad(l->builder, l->env->var_lambdas, "");
-	gep = LLVMBuildGEP(l->builder, ptr, &index, 1, "");
-	return LLVMBuildLoad(l->builder, gep, "");
+	ptr = build_load_global(b, env->var_lambdas, "");
+	gep = LLVMBuildGEP2(b, ptr_type, ptr, &index, 1, "");
+	return LLVMBuildLoad2(b, ptr_type, gep, "");
 }
 
-static void build_string(struct lambda *l)
+/* call the lambda whose id is only known at run time; with --tiered, it
+   may still be interpreted, so tier_call() decides */
+static LLVMValueRef build_indirect_call(struct environment *env,
+		LLVMBuilderRef b, LLVMValueRef id)
 {
-	struct growbuf *buf;
-	LLVMValueRef str, global, indices[2];
-	int ch;
-	char tmp;
-	/* four billion strings ought to be enough
-	   for everyone :-) */
-	char name_buf[sizeof("string_4000000000")];
+	if (options.tiered)
+		return build_fn_call(b, env->func_tier_call, &id, 1, "");
+	return LLVMBuildCall2(b, env->lambda_type, load_lambdas(env, b, id),
+			NULL, 0, "");
+}
+
+/* returns the function that calls the lambda stored in variable var */
+static LLVMValueRef get_var_dispatcher(struct environment *env, int var)
+{
+	char name[sizeof("call_x")];
+	LLVMTypeRef i32t = LLVMInt32Type();
 
-	buf = growbuf_new();
-	while((ch = l_getchar(l)) != EOF && ch != '"') {
-		tmp = ch;
-		growbuf_add(buf, &tmp, 1);
+	if (!env->call_var[var]) {
+		snprintf(name, sizeof(name), "call_%c", 'a' + var);
+		env->call_var[var] = LLVMAddFunction(env->module, name,
+				LLVMFunctionType(LLVMVoidType(), &i32t, 1, false));
+		set_linkage(env->call_var[var], LINKAGE_CODE);
 	}
 
-	if (ch == EOF)
-		l_error(l, "Unexpected end of file inside string.");
+	return env->call_var[var];
+}
 
-	str = LLVMConstString(growbuf_buf(buf),
-			growbuf_len(buf), false);
-	growbuf_free(buf);
+/*
+ * Mark a call that is directly followed by a return as a tail call, so that
+ * '!' at the end of a lambda doesn't grow the native stack. All lambdas use
+ * the C calling convention and have no stack arguments, so the backend can
+ * always turn these calls into jumps. Newer LLVMs let us insist on it where
+ * the prototypes match, as musttail requires.
+ */
+static void set_tail_call(LLVMValueRef call)
+{
+#if LLVM_VERSION_MAJOR >= 18
+	LLVMValueRef caller = LLVMGetBasicBlockParent(LLVMGetInstructionParent(call));
 
-	/* add global, init with str */
-	snprintf(name_buf, sizeof(name_buf), "string_%lu",
-			(unsigned long) l->env->string_id);
-	l->env->string_id++;
+	if (LLVMGetCalledFunctionType(call) == LLVMGlobalGetValueType(caller)) {
+		LLVMSetTailCallKind(call, LLVMTailCallKindMustTail);
+		return;
+	}
+#endif
+	LLVMSetTailCall(call, true);
+}
 
-	global = LLVMAddGlobal(l->env->module, LLVMTypeOf(str), name_buf);
-	set_linkage(global, LINKAGE_CONST_DATA);
-	LLVMSetInitializer(global, str);
+/*
+ * Build the body of a function that calls the lambda whose id it gets. If
+ * the lambda is expected to be known, it is called directly:
+ *
+ *   fn(id):
+ *     br id == known.id? direct : indirect
+ *   direct:
+ *     call known
+ *     ret
+ *   indirect:
+ *     call lambdas[id]
+ *     ret
+ *
+ * Returns the br, or NULL if known is NULL.
+ */
+static LLVMValueRef build_dispatch(struct environment *env, LLVMValueRef fn,
+		struct lambda *known)
+{
+	LLVMBuilderRef builder = env->builder;
+	LLVMBasicBlockRef direct_bb, indirect_bb;
+	LLVMValueRef id, cond, br = NULL;
+
+	LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlock(fn, ""));
+	id = LLVMGetParam(fn, 0);
+
+	if (known) {
+		direct_bb = LLVMAppendBasicBlock(fn, "direct");
+		indirect_bb = LLVMAppendBasicBlock(fn, "indirect");
+
+		cond = LLVMBuildICmp(builder, LLVMIntEQ, id,
+				u32_value(known->id), "");
+		br = LLVMBuildCondBr(builder, cond, direct_bb, indirect_bb);
+
+		LLVMPositionBuilderAtEnd(builder, direct_bb);
+		set_tail_call(build_fn_call(builder, known->fn, NULL, 0, ""));
+		LLVMBuildRetVoid(builder);
+
+		LLVMPositionBuilderAtEnd(builder, indirect_bb);
+	}
+
+	set_tail_call(build_indirect_call(env, builder, id));
+	LLVMBuildRetVoid(builder);
+	return br;
+}
+
+/*
+ * Call the lambda in sv. The callee sees (and may change) the global stack.
+ *
+ * Lambdas that are known at compile time are called directly, so that LLVM
+ * can inline them. Calls of lambdas that were just loaded from a variable go
+ * through the variable's dispatcher, which turns into a direct call if only
+ * one lambda is ever stored in that variable.
+ */
+static void build_lambda_call(struct lambda *l, struct stack_value sv)
+{
+	spill_stack(l);
+
+	if (sv.lambda)
+		build_fn_call(l->builder, sv.lambda->fn, NULL, 0, "");
+	else if (sv.var >= 0)
+		build_fn_call(l->builder, get_var_dispatcher(l->env, sv.var),
+				&sv.value, 1, "");
+	else
+		build_indirect_call(l->env, l->builder, sv.value);
+
+	invalidate_sp(l);
+}
+
+/* returns the variable that ref refers to, or -1 if it isn't constant */
+static int const_var_ref(LLVMValueRef ref)
+{
+	if (LLVMIsAConstantInt(ref) && LLVMConstIntGetZExtValue(ref) < 26)
+		return LLVMConstIntGetZExtValue(ref);
+	return -1;
+}
+
+/* keep track of the lambdas stored in variables; lambda is NULL if the
+   stored value isn't a known lambda */
+static void note_var_store(struct lambda *l, LLVMValueRef ref,
+		struct lambda *lambda)
+{
+	struct environment *env = l->env;
+	int var = const_var_ref(ref);
+
+	if (var < 0) {
+		env->dynamic_store = true;
+		forget_vars(l);
+		return;
+	}
+
+	l->var_lambda[var] = lambda;
+	if (!lambda || (env->stored_lambda[var] &&
+				env->stored_lambda[var] != lambda))
+		env->var_clobbered[var] = true;
+	env->stored_lambda[var] = lambda;
+}
+
+static void build_string(struct lambda *l, struct insn *insn)
+{
+	LLVMValueRef str, indices[2];
+	/* four billion strings ought to be enough
+	   for everyone :-) */
+	char name_buf[sizeof("string_4000000000")];
+
+	if (!insn->u.str.global) {
+		str = LLVMConstString(insn->u.str.text, insn->u.str.len, false);
+
+		/* add global, init with str */
+		snprintf(name_buf, sizeof(name_buf), "string_%lu",
+				(unsigned long) l->env->string_id);
+		l->env->string_id++;
+
+		insn->u.str.global = LLVMAddGlobal(l->env->module,
+				LLVMTypeOf(str), name_buf);
+		set_linkage(insn->u.str.global, LINKAGE_CONST_DATA);
+		/* the address doesn't matter, so each partition of the program
+		   (see compile_partitions) may have its own copy */
+		LLVMSetUnnamedAddress(insn->u.str.global, LLVMGlobalUnnamedAddr);
+		LLVMSetInitializer(insn->u.str.global, str);
+	}
 
 	/* load from global, pass value to call inst */
 	indices[0] = u32_value(0);
 	indices[1] = indices[0];
-	str = LLVMBuildGEP(l->builder, global, indices, 2, "");
+	str = LLVMBuildGEP2(l->builder,
+			LLVMGlobalGetValueType(insn->u.str.global),
+			insn->u.str.global, indices, 2, "");
 	LLVMBuildCall(l->builder, l->env->func_printstring, &str, 1, "");
 }
 
@@ -349,93 +1240,1050 @@ static void build_icmp_op(struct lambda *l, LLVMIntPredicate op)
 }
 
 /*
- * The generated code is basically:
- * parent:
- *   pop body_fn
- *   pop cond
- *   br cond? body : out
- * body:
- *   call body_fn
- *   br out
- * out:
- *   (new empty bb)
+ * Find the source positions of all lambdas and instructions, for --profile
+ * and -g. Parsing only keeps track of offsets, see source_position().
  */
-static void build_if(struct lambda *l)
-{
-	/* stack: bool,fn - */
-	LLVMValueRef cond_v, cond, body_l, body_fn;
-	LLVMBasicBlockRef body_bb, out_bb;
-
-	body_l = pop_stack(l);
-	cond_v = pop_stack(l);
-
-	body_fn = load_lambdas(l, body_l);
-	cond = LLVMBuildIsNotNull(l->builder, cond_v, "");
+struct code_position {
+	size_t offset;
+	struct lambda *l;
+	struct insn *insn;	/* NULL for the lambda itself */
+};
 
-	body_bb = l_new_bb(l);
-	out_bb = l_new_bb(l);
+static int compare_positions(const void *a, const void *b)
+{
+	const struct code_position *pa = a, *pb = b;
 
-	LLVMBuildCondBr(l->builder, cond, body_bb, out_bb);
+	return (pa->offset > pb->offset) - (pa->offset < pb->offset);
+}
 
-	LLVMPositionBuilderAtEnd(l->builder, body_bb);
-	LLVMBuildCall(l->builder, body_fn, NULL, 0, "");
-	LLVMBuildBr(l->builder, out_bb);
+static void locate_code(struct environment *env)
+{
+	struct code_position *pos;
+	struct lambda *l;
+	unsigned int i, j, n = 0, size = 0;
+
+	for (i = 0; i < env->n_lambdas; i++)
+		size += 1 + env->lambdas[i]->n_code;
+	pos = xmalloc(size * sizeof(*pos));
+	for (i = 0; i < env->n_lambdas; i++) {
+		l = env->lambdas[i];
+		pos[n].offset = l->start;
+		pos[n].l = l;
+		pos[n++].insn = NULL;
+		for (j = 0; j < l->n_code; j++) {
+			pos[n].offset = l->code[j].offset;
+			pos[n].l = l;
+			pos[n++].insn = &l->code[j];
+		}
+	}
 
-	LLVMPositionBuilderAtEnd(l->builder, out_bb);
-	l->bb = out_bb;
+	/* source_position() is fast for increasing offsets */
+	qsort(pos, n, sizeof(*pos), compare_positions);
+	for (i = 0; i < n; i++) {
+		struct insn *insn = pos[i].insn;
+
+		if (insn)
+			source_position(env, pos[i].offset, &insn->line,
+					&insn->column);
+		else
+			source_position(env, pos[i].offset, &pos[i].l->line,
+					&pos[i].l->column);
+	}
+	free(pos);
 }
 
 /*
- * parent:
- *   pop body_fn
- *   pop cond_fn
- *   br head
- * head:
- *   call cond_fn
- *   pop cond
- *   br cond? body:out
- * body:
- *   call body_fn
- *   br head
- * out:
- *   (new empty bb)
+ * --profile: Each lambda gets a counter for how often it runs (and one for
+ * the cycles spent in it, with --profile=cycles), each '?' one for each of
+ * its branches, and each '#' one for the iterations of its body and one for
+ * the times the loop ends. Each '!' gets 2 * LF_PROFILE_VALUES counters, in
+ * which lf_profile_value() keeps track of the lambdas it calls most often,
+ * if they aren't known at compile time. The counters are the elements of
+ * profile_counters, and at the end of main, lf_profile_write() writes them
+ * out in the "folded stacks" format that flame graph tools read, under names
+ * like "lambda_3@4:2;?@5:7;then" (the '?' at line 5, column 7 in lambda 3,
+ * which starts at line 4, column 2). The names are the lines of
+ * profile_keys, prefixed with 'n' for counts, 'c' for cycles and 'v' for
+ * the lambdas called by a '!'.
+ *
+ * --profile-use reads such a file back in, see load_profile().
  */
-static void build_while(struct lambda *l)
+static bool is_site(struct insn *insn)
 {
-	LLVMValueRef cond_l, body_l, cond_fn, body_fn, cond_v, cond;
-	LLVMBasicBlockRef head_bb, body_bb, out_bb;
+	return insn->op == OP_IF || insn->op == OP_WHILE || insn->op == OP_CALL;
+}
 
-	head_bb = l_new_bb(l);
-	body_bb = l_new_bb(l);
-	out_bb = l_new_bb(l);
+/* the name of a lambda's counter, or of a site's if insn isn't NULL,
+   followed by what */
+static void site_name(char *buf, size_t size, struct lambda *l,
+		struct insn *insn, const char *what)
+{
+	int len;
+
+	if (insn)
+		l = insn->u.site.lambda;
+	len = snprintf(buf, size, "lambda_%u@%u:%u", l->id, l->line, l->column);
+	if (insn)
+		len += snprintf(buf + len, size - len, ";%c@%u:%u", insn->op,
+				insn->line, insn->column);
+	if (what)
+		snprintf(buf + len, size - len, ";%s", what);
+}
 
-	body_l = pop_stack(l);
-	cond_l = pop_stack(l);
-	body_fn = load_lambdas(l, body_l);
-	cond_fn = load_lambdas(l, cond_l);
-	LLVMBuildBr(l->builder, head_bb);
+static void prepare_profile(struct environment *env)
+{
+	struct lambda *l;
+	struct insn *insn;
+	LLVMTypeRef i64t, t, parm_write[3], parm_value[2];
+	LLVMValueRef keys, global, indices[2];
+	unsigned int i, j;
+	char *text = NULL, name[128];
+	size_t text_len = 0;
+	FILE *fp;
+
+	fp = open_memstream(&text, &text_len);
+	if (!fp) {
+		perror("open_memstream");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < env->n_lambdas; i++) {
+		l = env->lambdas[i];
+		site_name(name, sizeof(name), l, NULL, NULL);
+		l->profile_base = env->n_profile++;
+		fprintf(fp, "n%s\n", name);
+		if (options.profile == PROFILE_CYCLES) {
+			env->n_profile++;
+			fprintf(fp, "c%s\n", name);
+		}
+
+		for (j = 0; j < l->n_code; j++) {
+			insn = &l->code[j];
+			if (!is_site(insn))
+				continue;
+
+			insn->u.site.counter = env->n_profile;
+			if (insn->op == OP_CALL) {
+				env->n_profile += 2 * LF_PROFILE_VALUES;
+				site_name(name, sizeof(name), l, insn, NULL);
+				fprintf(fp, "v%s\n", name);
+				continue;
+			}
+
+			env->n_profile += 2;
+			site_name(name, sizeof(name), l, insn,
+					insn->op == OP_IF? "then" : "body");
+			fprintf(fp, "n%s\n", name);
+			site_name(name, sizeof(name), l, insn,
+					insn->op == OP_IF? "else" : "exit");
+			fprintf(fp, "n%s\n", name);
+		}
+	}
+	fclose(fp);
+
+	/* define uint64_t profile_counters[n]; */
+	i64t = LLVMInt64Type();
+	t = LLVMArrayType(i64t, env->n_profile);
+	env->var_profile = LLVMAddGlobal(env->module, t, "profile_counters");
+	set_linkage(env->var_profile, LINKAGE_DATA);
+	LLVMSetInitializer(env->var_profile, LLVMConstNull(t));
+
+	/* define const char profile_keys[]; */
+	keys = LLVMConstString(text, text_len, false);
+	free(text);
+	global = LLVMAddGlobal(env->module, LLVMTypeOf(keys), "profile_keys");
+	set_linkage(global, LINKAGE_CONST_DATA);
+	LLVMSetGlobalConstant(global, true);
+	LLVMSetInitializer(global, keys);
+	indices[1] = indices[0] = u32_value(0);
+	env->profile_keys = LLVMConstInBoundsGEP2(
+			LLVMGlobalGetValueType(global), global, indices, 2);
+
+	/* extern void lf_profile_write(const uint64_t *counters,
+			const char *keys, uint32_t n); */
+	parm_write[0] = LLVMPointerType(i64t, 0);
+	parm_write[1] = LLVMPointerType(LLVMInt8Type(), 0);
+	parm_write[2] = LLVMInt32Type();
+	env->func_profile_write = LLVMAddFunction(env->module,
+			"lf_profile_write",
+			LLVMFunctionType(LLVMVoidType(), parm_write, 3, false));
+
+	/* extern void lf_profile_value(uint64_t *slots, uint32_t value); */
+	parm_value[0] = LLVMPointerType(i64t, 0);
+	parm_value[1] = LLVMInt32Type();
+	env->func_profile_value = LLVMAddFunction(env->module,
+			"lf_profile_value",
+			LLVMFunctionType(LLVMVoidType(), parm_value, 2, false));
+
+	if (options.profile == PROFILE_CYCLES)
+		env->func_readcyclecounter = LLVMAddFunction(env->module,
+				"llvm.readcyclecounter",
+				LLVMFunctionType(i64t, NULL, 0, false));
+}
+
+static LLVMValueRef get_counter(struct environment *env, uint32_t counter)
+{
+	LLVMValueRef indices[2];
+
+	indices[0] = u32_value(0);
+	indices[1] = u32_value(counter);
+	return LLVMConstInBoundsGEP2(LLVMGlobalGetValueType(env->var_profile),
+			env->var_profile, indices, 2);
+}
+
+/* add value (an i64) to a profile counter */
+static void add_to_counter(struct lambda *l, uint32_t counter, LLVMValueRef value)
+{
+	LLVMValueRef ptr, sum;
+
+	ptr = get_counter(l->env, counter);
+	sum = LLVMBuildLoad2(l->builder, LLVMInt64Type(), ptr, "");
+	sum = LLVMBuildAdd(l->builder, sum, value, "");
+	LLVMBuildStore(l->builder, sum, ptr);
+}
+
+static void count_event(struct lambda *l, uint32_t counter)
+{
+	if (options.profile)
+		add_to_counter(l, counter,
+				LLVMConstInt(LLVMInt64Type(), 1, false));
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct profile_entry *ea = a, *eb = b;
+
+	return strcmp(ea->name, eb->name);
+}
+
+/*
+ * --profile-use: Read a profile that a program compiled with --profile
+ * wrote. The counts are looked up by name during code generation, see
+ * profile_count(): '?' and '#' get branch weights, lambdas get entry
+ * counts and are marked as hot or cold, and a '!' that calls the same
+ * lambda most of the time calls it directly, see build_call().
+ */
+static void load_profile(struct environment *env, const char *file)
+{
+	struct profile_entry *e;
+	unsigned int size = 0, lineno = 0;
+	uint64_t total = 0;
+	char *line = NULL, *space, *end;
+	size_t line_size = 0;
+	ssize_t len;
+	FILE *fp;
+
+	fp = xfopen(file, "r");
+	while ((len = getline(&line, &line_size, fp)) > 0) {
+		lineno++;
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!len)
+			continue;
+
+		if (env->n_profile_entries == size) {
+			size = size? 2 * size : 256;
+			env->profile = arena_grow(&env->arena, env->profile,
+					env->n_profile_entries * sizeof(*e),
+					size * sizeof(*e));
+		}
+		e = &env->profile[env->n_profile_entries++];
+
+		space = strrchr(line, ' ');
+		if (!space || space == line)
+			goto malformed;
+		errno = 0;
+		e->count = strtoull(space + 1, &end, 10);
+		if (*end || end == space + 1 || errno)
+			goto malformed;
+		e->name = arena_alloc(&env->arena, space - line + 1);
+		memcpy(e->name, line, space - line);
+		e->name[space - line] = '\0';
+		e->used = false;
+
+		/* lambdas are named "lambda_N@L:C", everything else has a
+		   ';' in it */
+		if (!strchr(e->name, ';'))
+			total += e->count;
+	}
+	if (ferror(fp)) {
+		fprintf(stderr, "error: Can't read '%s': %s\n", file,
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fclose(fp);
+	free(line);
+
+	qsort(env->profile, env->n_profile_entries, sizeof(*env->profile),
+			compare_entries);
+
+	/* lambdas that account for 1% of all runs are hot */
+	env->profile_hot = total / 100? total / 100 : 1;
+	return;
+
+malformed:
+	fprintf(stderr, "%s:%u: error: Malformed profile line.\n", file, lineno);
+	exit(EXIT_FAILURE);
+}
+
+/* the first entry whose name is name or starts with it */
+static struct profile_entry *find_profile_entry(struct environment *env,
+		const char *name)
+{
+	unsigned int lo = 0, hi = env->n_profile_entries, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(env->profile[mid].name, name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return &env->profile[lo];
+}
+
+/* the count of a lambda or site in the --profile-use file; counters that
+   are missing never counted anything */
+static uint64_t profile_count(struct lambda *l, struct insn *insn,
+		const char *what)
+{
+	struct environment *env = l->env;
+	struct profile_entry *e;
+	char name[128];
+
+	site_name(name, sizeof(name), l, insn, what);
+	e = find_profile_entry(env, name);
+	if (e == env->profile + env->n_profile_entries || strcmp(e->name, name))
+		return 0;
+	e->used = true;
+	return e->count;
+}
+
+/* warn if parts of the profile didn't belong to anything in the program */
+static void check_profile(struct environment *env, const char *file)
+{
+	unsigned int i, unused = 0;
+
+	for (i = 0; i < env->n_profile_entries; i++)
+		if (!env->profile[i].used)
+			unused++;
+	if (unused)
+		fprintf(stderr, "warning: %u of the counts in '%s' don't match "
+				"the program, was it changed?\n", unused, file);
+}
+
+static void set_prof_metadata(LLVMValueRef br, const char *kind,
+		uint64_t a, uint64_t b)
+{
+	LLVMContextRef ctx = LLVMGetGlobalContext();
+	LLVMMetadataRef md[3];
+
+	/* branch weights are 32 bits wide */
+	while (a > UINT32_MAX || b > UINT32_MAX) {
+		a >>= 1;
+		b >>= 1;
+	}
+	md[0] = LLVMMDStringInContext2(ctx, kind, strlen(kind));
+	md[1] = LLVMValueAsMetadata(LLVMConstInt(LLVMInt32Type(), a, false));
+	md[2] = LLVMValueAsMetadata(LLVMConstInt(LLVMInt32Type(), b, false));
+	LLVMSetMetadata(br, LLVMGetMDKindID("prof", 4),
+			LLVMMetadataAsValue(ctx, LLVMMDNodeInContext2(ctx, md, 3)));
+}
+
+/* with --profile-use, weigh the branches of a conditional br by the
+   counts of a site */
+static void set_branch_weights(struct lambda *l, LLVMValueRef br,
+		struct insn *insn, const char *taken, const char *not_taken)
+{
+	uint64_t a, b;
+
+	if (!l->env->n_profile_entries)
+		return;
+	a = profile_count(l, insn, taken);
+	b = profile_count(l, insn, not_taken);
+	if (a || b)
+		set_prof_metadata(br, "branch_weights", a, b);
+}
+
+static void add_fn_attribute(LLVMValueRef fn, const char *name)
+{
+	unsigned int kind = LLVMGetEnumAttributeKindForName(name, strlen(name));
+
+	if (kind)
+		LLVMAddAttributeAtIndex(fn, LLVMAttributeFunctionIndex,
+				LLVMCreateEnumAttribute(LLVMGetGlobalContext(),
+					kind, 0));
+}
+
+/* with --profile-use, tell LLVM how often a lambda runs */
+static void set_entry_count(struct lambda *l)
+{
+	LLVMContextRef ctx = LLVMGetGlobalContext();
+	LLVMMetadataRef md[2];
+	uint64_t count;
+
+	if (!l->env->n_profile_entries)
+		return;
+	count = profile_count(l, NULL, NULL);
+
+	md[0] = LLVMMDStringInContext2(ctx, "function_entry_count",
+			strlen("function_entry_count"));
+	md[1] = LLVMValueAsMetadata(LLVMConstInt(LLVMInt64Type(), count,
+				false));
+	LLVMGlobalSetMetadata(l->fn, LLVMGetMDKindID("prof", 4),
+			LLVMMDNodeInContext2(ctx, md, 2));
+
+	if (!count)
+		add_fn_attribute(l->fn, "cold");
+	else if (count >= l->env->profile_hot)
+		add_fn_attribute(l->fn, "hot");
+}
+
+/*
+ * The lambda that a '!' called most often according to the --profile-use
+ * file, if it made up more than half of the calls that were counted; see
+ * lf_profile_value() for why the counts are only approximate. *hits and
+ * *misses are set to the calls of that lambda and of all others.
+ */
+static struct lambda *profile_hot_call(struct lambda *l, struct insn *insn,
+		uint64_t *hits, uint64_t *misses)
+{
+	struct environment *env = l->env;
+	struct profile_entry *e;
+	struct lambda *hot = NULL;
+	uint64_t total = 0;
+	unsigned long id;
+	size_t len;
+	char name[128], *end;
+
+	if (!env->n_profile_entries)
+		return NULL;
+
+	/* the entries are "<site>;lambda_<id>", see lf_profile_write() */
+	site_name(name, sizeof(name), l, insn, "lambda_");
+	len = strlen(name);
+	*hits = 0;
+	for (e = find_profile_entry(env, name);
+			e < env->profile + env->n_profile_entries &&
+			!strncmp(e->name, name, len); e++) {
+		id = strtoul(e->name + len, &end, 10);
+		if (*end || id >= env->n_lambdas)
+			continue;
+		e->used = true;
+		total += e->count;
+		if (e->count > *hits) {
+			*hits = e->count;
+			hot = env->lambdas[id];
+		}
+	}
+
+	*misses = total - *hits;
+	return *hits > *misses? hot : NULL;
+}
+
+/*
+ * '!': With --profile, the lambdas that are called are counted, unless the
+ * lambda is known at compile time. With --profile-use, a lambda that is
+ * called most of the time is called directly, through a function like the
+ * call_<var> dispatchers, so that the call can still be a tail call.
+ */
+static void build_call(struct lambda *l, struct insn *insn)
+{
+	struct environment *env = l->env;
+	struct stack_value sv = pop_stack_value(l);
+	struct lambda *hot;
+	LLVMBasicBlockRef bb;
+	LLVMValueRef args[2], fn, br;
+	LLVMMetadataRef loc;
+	uint64_t hits, misses;
+	LLVMTypeRef i32t = LLVMInt32Type();
+	char name[sizeof("call_4000000000_4000000000")];
+
+	if (sv.lambda) {
+		build_lambda_call(l, sv);
+		return;
+	}
+
+	if (options.profile) {
+		args[0] = get_counter(env, insn->u.site.counter);
+		args[1] = sv.value;
+		build_fn_call(l->builder, env->func_profile_value, args, 2, "");
+	}
+
+	hot = profile_hot_call(l, insn, &hits, &misses);
+	if (!hot) {
+		build_lambda_call(l, sv);
+		return;
+	}
+
+	snprintf(name, sizeof(name), "call_%u_%u",
+			insn->u.site.lambda->id, hot->id);
+	fn = LLVMAddFunction(env->module, name,
+			LLVMFunctionType(LLVMVoidType(), &i32t, 1, false));
+	set_linkage(fn, LINKAGE_CODE);
+	/* the dispatcher doesn't have debug info of its own */
+	bb = LLVMGetInsertBlock(l->builder);
+	loc = LLVMGetCurrentDebugLocation2(l->builder);
+	LLVMSetCurrentDebugLocation2(l->builder, NULL);
+	br = build_dispatch(env, fn, hot);
+	set_prof_metadata(br, "branch_weights", hits, misses);
+	LLVMPositionBuilderAtEnd(l->builder, bb);
+	LLVMSetCurrentDebugLocation2(l->builder, loc);
+
+	spill_stack(l);
+	build_fn_call(l->builder, fn, &sv.value, 1, "");
+	invalidate_sp(l);
+}
+
+/*
+ * -g: Each lambda gets a DISubprogram, and the code generated for each
+ * instruction the position of its False command. The DWARF language is C,
+ * as there is no code for False; debuggers and perf only need the line
+ * table anyway. Literal lambdas that are inlined keep their own positions,
+ * but in the scope of the lambda they are inlined into.
+ */
+static void prepare_debug_info(struct environment *env)
+{
+	LLVMDIBuilderRef dib;
+	char *dir;
+
+	dir = getcwd(NULL, 0);
+	if (!dir) {
+		perror("getcwd");
+		exit(EXIT_FAILURE);
+	}
+
+	dib = env->dibuilder = LLVMCreateDIBuilder(env->module);
+	env->di_file = LLVMDIBuilderCreateFile(dib, env->file,
+			strlen(env->file), dir, strlen(dir));
+	free(dir);
+	LLVMDIBuilderCreateCompileUnit(dib, LLVMDWARFSourceLanguageC,
+			env->di_file, "llfalse", strlen("llfalse"),
+			options.opt_level != '0', "", 0, 0, "", 0,
+			LLVMDWARFEmissionFull, 0, false, false, "", 0, "", 0);
+	env->di_lambda_type = LLVMDIBuilderCreateSubroutineType(dib,
+			env->di_file, NULL, 0, LLVMDIFlagZero);
+
+	LLVMAddModuleFlag(env->module, LLVMModuleFlagBehaviorWarning,
+			"Debug Info Version", strlen("Debug Info Version"),
+			LLVMValueAsMetadata(u32_value(LLVMDebugMetadataVersion())));
+	LLVMAddModuleFlag(env->module, LLVMModuleFlagBehaviorWarning,
+			"Dwarf Version", strlen("Dwarf Version"),
+			LLVMValueAsMetadata(u32_value(4)));
+}
+
+static void set_debug_location(struct lambda *l, unsigned int line,
+		unsigned int column)
+{
+	if (options.debug_info)
+		LLVMSetCurrentDebugLocation2(l->builder,
+				LLVMDIBuilderCreateDebugLocation(
+					LLVMGetGlobalContext(), line, column,
+					LLVMGetSubprogram(l->fn), NULL));
+}
+
+/* give the function of a lambda its DISubprogram */
+static void begin_debug_info(struct lambda *l)
+{
+	struct environment *env = l->env;
+	const char *name;
+	size_t len;
+
+	if (!options.debug_info)
+		return;
+
+	name = LLVMGetValueName2(l->fn, &len);
+	LLVMSetSubprogram(l->fn, LLVMDIBuilderCreateFunction(env->dibuilder,
+				env->di_file, name, len, name, len,
+				env->di_file, l->line, env->di_lambda_type,
+				true, true, l->line, LLVMDIFlagZero,
+				options.opt_level != '0'));
+	set_debug_location(l, l->line, l->column);
+}
+
+/* whether the code of l ends in a call of a lambda */
+static bool ends_in_call(struct lambda *l)
+{
+	return l->n_code && l->code[l->n_code - 1].op == OP_CALL;
+}
+
+/*
+ * Return from the function of l. If the code that was generated last is a
+ * '!', the call is a tail call, so that tail recursion doesn't grow the
+ * native stack.
+ */
+static void build_return(struct lambda *l, bool tail_call)
+{
+	LLVMValueRef last, cycles;
+
+	spill_stack(l);
+	last = LLVMGetLastInstruction(LLVMGetInsertBlock(l->builder));
+	tail_call = tail_call && last && LLVMIsACallInst(last);
+	if (tail_call)
+		set_tail_call(last);
+	if (l->start_cycles) {
+		/* the cycles of a tail call aren't counted, it has to stay
+		   right before the return */
+		if (tail_call)
+			LLVMPositionBuilderBefore(l->builder, last);
+		cycles = build_fn_call(l->builder, l->env->func_readcyclecounter,
+				NULL, 0, "");
+		add_to_counter(l, l->profile_base + 1,
+				LLVMBuildSub(l->builder, cycles, l->start_cycles, ""));
+		LLVMPositionBuilderAtEnd(l->builder,
+				LLVMGetInsertBlock(l->builder));
+	}
+	LLVMBuildRetVoid(l->builder);
+}
+
+static void gen_code(struct lambda *l, struct lambda *src);
+
+/*
+ * Run the code of a lambda: known lambdas are inlined into l, everything
+ * else is called. So are lambdas whose code is already being generated, as
+ * they would be inlined into themselves forever, and all lambdas once
+ * MAX_INLINE_SIZE instructions have been inlined into the function, so that
+ * long chains of lambdas that run each other don't make it grow without
+ * bound.
+ *
+ * Returns whether the lambda was inlined.
+ */
+static bool gen_body(struct lambda *l, struct stack_value sv)
+{
+	struct lambda *body = sv.lambda;
+
+	if (!body || body->inlining ||
+	    l->inline_size + body->n_code > MAX_INLINE_SIZE) {
+		build_lambda_call(l, sv);
+		return false;
+	}
+
+	l->inline_size += body->n_code;
+	body->inlining = true;
+	count_event(l, body->profile_base);
+	gen_code(l, body);
+	body->inlining = false;
+	return true;
+}
+
+/*
+ * Delete the code generated since a certain point: All instructions in bb
+ * after mark (or all of them, if mark is NULL) and all basic blocks from
+ * first to the end of the function.
+ */
+static void discard_code(struct lambda *l, LLVMBasicBlockRef bb,
+		LLVMValueRef mark, LLVMBasicBlockRef first)
+{
+	LLVMBasicBlockRef b, next_b;
+	LLVMValueRef i, prev_i;
+
+	/* first, drop all uses of the doomed instructions */
+	for (b = first; b; b = LLVMGetNextBasicBlock(b))
+		for (i = LLVMGetFirstInstruction(b); i; i = LLVMGetNextInstruction(i))
+			LLVMReplaceAllUsesWith(i, LLVMGetUndef(LLVMTypeOf(i)));
+	for (i = mark? LLVMGetNextInstruction(mark) : LLVMGetFirstInstruction(bb);
+			i; i = LLVMGetNextInstruction(i))
+		LLVMReplaceAllUsesWith(i, LLVMGetUndef(LLVMTypeOf(i)));
+
+	for (i = LLVMGetLastInstruction(bb); i != mark; i = prev_i) {
+		prev_i = LLVMGetPreviousInstruction(i);
+		LLVMInstructionEraseFromParent(i);
+	}
+	for (b = first; b; b = LLVMGetNextBasicBlock(b))
+		while ((i = LLVMGetLastInstruction(b)))
+			LLVMInstructionEraseFromParent(i);
+	for (b = first; b; b = next_b) {
+		next_b = LLVMGetNextBasicBlock(b);
+		LLVMDeleteBasicBlock(b);
+	}
+
+	LLVMPositionBuilderAtEnd(l->builder, bb);
+}
+
+/*
+ * If the body is a literal lambda, it is inlined:
+ *
+ * parent:
+ *   pop body
+ *   pop cond
+ *   br cond? then : else
+ * then:
+ *   (body)
+ *   spill until k values are left
+ *   br out
+ * else:
+ *   spill until k values are left
+ *   br out
+ * out:
+ *   phi nodes for the stack elements that differ
+ *
+ * k is the smaller of the virtual stack sizes at the end of both branches,
+ * so that only spills are needed to make them agree.
+ *
+ * If the '?' is the last thing the function does, the then branch returns
+ * by itself instead, and the function goes on in the else branch. That
+ * makes a '!' at the end of the body a tail call, as in the usual form of
+ * tail recursion, "[$0>[1-f;!]?]f:".
+ */
+static void build_if(struct lambda *l, struct insn *insn)
+{
+	/* stack: bool,fn - */
+	struct stack_value body;
+	struct stack_state then_st, else_st;
+	LLVMValueRef cond_v, cond, br;
+	LLVMBasicBlockRef then_bb, else_bb, out_bb, then_end_bb;
+	unsigned int k;
+	bool inlined;
+
+	body = pop_stack_value(l);
+	cond_v = pop_stack(l);
 
-	LLVMPositionBuilderAtEnd(l->builder, head_bb);
-	LLVMBuildCall(l->builder, cond_fn, NULL, 0, "");
-	cond_v = pop_stack(l);
 	cond = LLVMBuildIsNotNull(l->builder, cond_v, "");
-	LLVMBuildCondBr(l->builder, cond, body_bb, out_bb);
 
-	LLVMPositionBuilderAtEnd(l->builder, body_bb);
-	LLVMBuildCall(l->builder, body_fn, NULL, 0, "");
+	then_bb = l_new_bb(l);
+	else_bb = l_new_bb(l);
+
+	get_sp(l);
+	br = LLVMBuildCondBr(l->builder, cond, then_bb, else_bb);
+	set_branch_weights(l, br, insn, "then", "else");
+	save_stack(l, &else_st);
+
+	LLVMPositionBuilderAtEnd(l->builder, then_bb);
+	count_event(l, insn->u.site.counter);
+	inlined = gen_body(l, body);
+	if (l->tail) {
+		build_return(l, inlined? ends_in_call(body.lambda) : true);
+
+		LLVMPositionBuilderAtEnd(l->builder, else_bb);
+		count_event(l, insn->u.site.counter + 1);
+		restore_stack(l, &else_st);
+		/* what the then branch stored didn't happen here */
+		forget_vars(l);
+		return;
+	}
+
+	out_bb = l_new_bb(l);
+	k = l->vs_len < else_st.vs_len? l->vs_len : else_st.vs_len;
+	shrink_vs(l, k);
+	get_sp(l);
+	then_end_bb = LLVMGetInsertBlock(l->builder);
+	LLVMBuildBr(l->builder, out_bb);
+	save_stack(l, &then_st);
+
+	LLVMPositionBuilderAtEnd(l->builder, else_bb);
+	count_event(l, insn->u.site.counter + 1);
+	restore_stack(l, &else_st);
+	shrink_vs(l, k);
+	LLVMBuildBr(l->builder, out_bb);
+	save_stack(l, &else_st);
+
+	LLVMPositionBuilderAtEnd(l->builder, out_bb);
+	merge_stacks(l, &then_st, then_end_bb, &else_st, else_bb);
+}
+
+/*
+ * If cond and body are literal lambdas, they are inlined, and the k topmost
+ * elements of the virtual stack are carried around the loop in phi nodes:
+ *
+ * parent:
+ *   pop body
+ *   pop cond
+ *   spill until k values are left
+ *   br head
+ * head:
+ *   phi nodes for sp and the k elements
+ *   (cond)
+ *   pop c
+ *   br c? body:out
+ * body:
+ *   (body)
+ *   spill until k values are left
+ *   br head
+ * out:
+ *   (new bb, with the stack state of the end of head)
+ *
+ * k starts out as the number of elements on the virtual stack. If the body
+ * leaves less than k elements, the loop is generated again with a smaller k,
+ * because filling up the virtual stack could read beyond the bottom of the
+ * stack.
+ */
+static void build_while(struct lambda *l, struct insn *insn)
+{
+	struct stack_value cond_l, body_l;
+	struct stack_state entry_st, out_st;
+	LLVMValueRef cond_v, cond, br, sp_phi, *phis = NULL, mark, values[1];
+	LLVMBasicBlockRef pre_bb, head_bb, body_bb, out_bb, end_bb;
+	unsigned int i, k, inline_size;
+
+	body_l = pop_stack_value(l);
+	cond_l = pop_stack_value(l);
+
+	/* the loop runs the bodies, not a return, see build_if() */
+	l->tail = false;
+
+	/* calls spill the whole stack anyway */
+	k = (cond_l.lambda && body_l.lambda)? l->vs_len : 0;
+
+	get_sp(l);
+	save_stack(l, &entry_st);
+	pre_bb = LLVMGetInsertBlock(l->builder);
+	mark = LLVMGetLastInstruction(pre_bb);
+	inline_size = l->inline_size;
+
+	while (1) {
+		head_bb = l_new_bb(l);
+		body_bb = l_new_bb(l);
+		out_bb = l_new_bb(l);
+
+		shrink_vs(l, k);
+		LLVMBuildBr(l->builder, head_bb);
+
+		LLVMPositionBuilderAtEnd(l->builder, head_bb);
+		sp_phi = LLVMBuildPhi(l->builder, LLVMInt32Type(), "sp");
+		LLVMAddIncoming(sp_phi, &l->sp, &pre_bb, 1);
+		phis = xrealloc(phis, (k + 1) * sizeof(*phis));
+		for (i = 0; i < k; i++) {
+			phis[i] = LLVMBuildPhi(l->builder, LLVMInt32Type(), "");
+			LLVMAddIncoming(phis[i], &l->vs[i].value, &pre_bb, 1);
+			l->vs[i].value = phis[i];
+			l->vs[i].lambda = NULL;
+			l->vs[i].var = -1;
+		}
+		set_sp(l, sp_phi);
+		forget_vars(l);
+
+		gen_body(l, cond_l);
+		cond_v = pop_stack(l);
+		cond = LLVMBuildIsNotNull(l->builder, cond_v, "");
+		get_sp(l);
+		br = LLVMBuildCondBr(l->builder, cond, body_bb, out_bb);
+		set_branch_weights(l, br, insn, "body", "exit");
+		save_stack(l, &out_st);
+
+		LLVMPositionBuilderAtEnd(l->builder, body_bb);
+		count_event(l, insn->u.site.counter);
+		gen_body(l, body_l);
+		if (l->vs_len >= k)
+			break;
+
+		/* try again with less elements in phi nodes */
+		k = l->vs_len;
+		discard_code(l, pre_bb, mark, head_bb);
+		free(out_st.vs);
+		restore_stack(l, &entry_st);
+		l->inline_size = inline_size;
+		save_stack(l, &entry_st);
+	}
+	free(entry_st.vs);
+
+	shrink_vs(l, k);
+	end_bb = LLVMGetInsertBlock(l->builder);
+	values[0] = get_sp(l);
+	LLVMAddIncoming(sp_phi, values, &end_bb, 1);
+	for (i = 0; i < k; i++)
+		LLVMAddIncoming(phis[i], &l->vs[i].value, &end_bb, 1);
 	LLVMBuildBr(l->builder, head_bb);
+	free(phis);
 
 	LLVMPositionBuilderAtEnd(l->builder, out_bb);
-	l->bb = out_bb;
+	count_event(l, insn->u.site.counter + 1);
+	restore_stack(l, &out_st);
+	forget_vars(l);
+}
+
+static struct insn *add_insn(struct lambda *l, enum opcode op)
+{
+	if (l->n_code == l->code_size) {
+		l->code_size = l->code_size? 2 * l->code_size : 16;
+		l->code = arena_grow(&l->env->arena, l->code,
+				l->n_code * sizeof(*l->code),
+				l->code_size * sizeof(*l->code));
+	}
+
+	l->code[l->n_code].op = op;
+	l->code[l->n_code].offset = l->env->cmd_pos;
+	return &l->code[l->n_code++];
+}
+
+static void add_push(struct lambda *l, uint32_t value)
+{
+	add_insn(l, OP_PUSH)->u.value = value;
+}
+
+static void parse_string(struct lambda *l)
+{
+	struct environment *env = l->env;
+	const unsigned char *start, *end;
+	struct insn *insn;
+
+	start = env->src + env->src_pos;
+	end = memchr(start, '"', env->src_len - env->src_pos);
+	if (!end) {
+		env->src_pos = env->src_len;
+		l_error(l, "Unexpected end of file inside string.");
+	}
+	env->src_pos = end + 1 - env->src;
+
+	insn = add_insn(l, OP_STRING);
+	insn->u.str.len = end - start;
+	insn->u.str.text = arena_alloc(&env->arena, insn->u.str.len + 1);
+	memcpy(insn->u.str.text, start, insn->u.str.len);
+	insn->u.str.text[insn->u.str.len] = '\0'; /* for --interpret */
+	insn->u.str.global = NULL;
 }
 
 static int ascii_isdigit(int x) { return x >= '0' && x <= '9'; }
 static uint32_t ascii_digit_value(int x) { return (uint32_t) (x - '0'); }
 
+/* compute "a op b" for a binary operator; false if it can't be folded */
+static bool fold_binop(enum opcode op, uint32_t a, uint32_t b, uint32_t *res)
+{
+	switch (op) {
+	case OP_ADD: *res = a + b; break;
+	case OP_SUB: *res = a - b; break;
+	case OP_MUL: *res = a * b; break;
+	case OP_AND: *res = a & b; break;
+	case OP_OR:  *res = a | b; break;
+	case OP_EQ:  *res = a == b? ~0U : 0; break;
+	case OP_GT:
+		if (options.unsigned_mode)
+			*res = a > b? ~0U : 0;
+		else
+			*res = (int32_t) a > (int32_t) b? ~0U : 0;
+		break;
+	case OP_DIV:
+		/* leave the errors to run time */
+		if (b == 0 || (!options.unsigned_mode &&
+					a == 0x80000000U && b == ~0U))
+			return false;
+		if (options.unsigned_mode)
+			*res = a / b;
+		else
+			*res = (uint32_t) ((int32_t) a / (int32_t) b);
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/* rewrite the last instructions of code[0..*n); returns true if something
+   changed, so that the new tail can be looked at again */
+static bool peephole_tail(struct insn *code, unsigned int *n)
+{
+	struct insn *a, *b, *c;
+	uint32_t res;
+
+	if (*n < 2)
+		return false;
+	a = *n >= 3? &code[*n - 3] : NULL;
+	b = &code[*n - 2];
+	c = &code[*n - 1];
+
+	switch (c->op) {
+	case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+	case OP_AND: case OP_OR: case OP_EQ: case OP_GT:
+		/* 10 3* -> 30 */
+		if (a && a->op == OP_PUSH && b->op == OP_PUSH &&
+		    fold_binop(c->op, a->u.value, b->u.value, &res)) {
+			a->u.value = res;
+			*n -= 2;
+			return true;
+		}
+		/* 1+ -> +1 */
+		if (b->op == OP_PUSH && (c->op == OP_ADD || c->op == OP_SUB)) {
+			b->u.value = c->op == OP_ADD? b->u.value : -b->u.value;
+			b->op = OP_ADD_CONST;
+			*n -= 1;
+			return true;
+		}
+		break;
+	case OP_NEG:
+	case OP_NOT:
+		if (b->op == OP_PUSH) {
+			b->u.value = c->op == OP_NEG? -b->u.value : ~b->u.value;
+			*n -= 1;
+			return true;
+		}
+		break;
+	case OP_ADD_CONST:
+		if (c->u.value == 0) {
+			*n -= 1;
+			return true;
+		}
+		if (b->op == OP_PUSH || b->op == OP_ADD_CONST) {
+			b->u.value += c->u.value;
+			*n -= 1;
+			return true;
+		}
+		break;
+	case OP_LOAD:
+	case OP_STORE:
+		/* a; -> load a */
+		if (b->op == OP_PUSH && b->u.value < 26) {
+			b->op = c->op == OP_LOAD? OP_LOAD_VAR : OP_STORE_VAR;
+			*n -= 1;
+			return true;
+		}
+		break;
+	case OP_PICK:
+		/* 0O -> $, 2O -> pick 2 */
+		if (b->op == OP_PUSH) {
+			b->op = b->u.value == 0? OP_DUP : OP_PICK_CONST;
+			*n -= 1;
+			return true;
+		}
+		break;
+	case OP_DUP:
+		/* 2$ -> 2 2 */
+		if (b->op == OP_PUSH || b->op == OP_LAMBDA) {
+			*c = *b;
+			return true;
+		}
+		break;
+	case OP_SWAP:
+		if (b->op == OP_SWAP) {
+			*n -= 2;
+			return true;
+		}
+		break;
+	case OP_DROP:
+		/* $% and 2% do nothing */
+		if (b->op == OP_DUP || b->op == OP_PUSH || b->op == OP_LAMBDA) {
+			*n -= 2;
+			return true;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+/*
+ * Simplify a lambda's code: fold constant expressions, cancel out sequences
+ * that do nothing, and turn common pairs like "a;" or "1+" into single
+ * instructions. Each instruction is appended to the output and then
+ * combined with what's before it, as often as possible.
+ */
+static void peephole(struct lambda *l)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < l->n_code; i++) {
+		l->code[n++] = l->code[i];
+		while (peephole_tail(l->code, &n))
+			;
+	}
+	l->n_code = n;
+}
+
 static void parse_lambda(struct lambda *l)
 {
 	while(1) {
 		int ch = l_getchar(l);
+		l->env->cmd_pos = l->env->src_pos - 1;
 reparse:
 		if (ch == EOF) {
 			if (l->id != 0)
@@ -450,7 +2298,7 @@ reparse:
 
 		if (ch >= 'a' && ch <= 'z') {
 			/* variable reference */
-			push_stack(l, u32_value(ch - 'a'));
+			add_push(l, ch - 'a');
 		} else if (ascii_isdigit(ch)) {
 			/* number */
 			uint32_t num = ascii_digit_value(ch);
@@ -459,9 +2307,10 @@ reparse:
 			while (ascii_isdigit((ch = l_getchar(l))))
 				num = 10 * num + ascii_digit_value(ch);
 
-			push_stack(l, u32_value(num));
+			add_push(l, num);
 
 			/* we still have the first non-digit character in ch */
+			l->env->cmd_pos = l->env->src_pos - 1;
 			goto reparse;
 		} else switch (ch) {
 		case ' ': /* ingore whitespace */
@@ -478,173 +2327,62 @@ reparse:
 				ch = 'O';
 			else
 				l_error(l, "Invalid UTF-8 seqence c3 %02x", ch);
-			l->column--;
 			goto reparse;
 		case '{': /* comment */
-			while ((ch = l_getchar(l)) != '}')
-				if (ch == EOF)
+			{
+				struct environment *env = l->env;
+				const unsigned char *end;
+
+				end = memchr(env->src + env->src_pos, '}',
+						env->src_len - env->src_pos);
+				if (!end) {
+					env->src_pos = env->src_len;
 					l_error(l, "Unexpected end of file. Use '}' to terminate comments");
-			break;
+				}
+				env->src_pos = end + 1 - env->src;
+			} break;
 		case '[': /* lambda */
 			{
-				struct lambda *new_l = l_new_child(l);
+				/* it starts at the '[' */
+				struct lambda *new_l = l_new(l->env,
+						l->env->src_pos - 1);
 				parse_lambda(new_l);
 
-				/* adjust lines and columns */
-				l->line = new_l->line;
-				l->column = new_l->column;
-
-				push_stack(l, u32_value(new_l->id));
+				l->env->cmd_pos = new_l->start;
+				add_insn(l, OP_LAMBDA)->u.lambda = new_l;
 			} break;
 		case '\'': /* char value */
 			ch = l_getchar(l);
 			if (ch == EOF)
 				l_error(l, "Unexpected end of file after apostroph (')");
-			push_stack(l, u32_value((uint32_t)(unsigned char) ch));
+			add_push(l, (uint32_t)(unsigned char) ch);
 			break;
 		case '`': /* inline assembly */
 			l_warning(l, "Inline assembly isn't supported, ignoring.");
 			break;
-		case ':': /* store */
-			{
-				/* stack: val, ref -> (nothing) */
-				LLVMValueRef val, ref;
-
-				ref = pop_stack(l);
-				val = pop_stack(l);
-
-				LLVMBuildStore(l->builder, val, index_variables(l, ref));
-			} break;
-		case ';': /* load */
-			{
-				LLVMValueRef ref, ptr, val;
-
-				ref = pop_stack(l);
-				ptr = index_variables(l, ref);
-				val = LLVMBuildLoad(l->builder, ptr, "");
-				push_stack(l, val);
-			} break;
-		case '!': /* call */
-			{ /* move code to call_lambda(index) */
-				/* lambdas are stored on the stack as 32-bit
-				   indices to a global array that contains pointers
-				   to the actual functions */
-				LLVMValueRef index, fn;
-
-				index = pop_stack(l);
-				fn = load_lambdas(l, index);
-				LLVMBuildCall(l->builder, fn, NULL, 0, "");
-			} break;
-		case '+': /* add */
-			build_simple_binop(l, LLVMAdd);
-			break;
-		case '-': /* sub */
-			build_simple_binop(l, LLVMSub);
-			break;
-		case '*': /* mult */
-			build_simple_binop(l, LLVMMul);
-			break;
-		case '/': /* div */
-			build_simple_binop(l, options.unsigned_mode?
-						LLVMUDiv : LLVMSDiv);
-			break;
-		case '&': /* and */
-			build_simple_binop(l, LLVMAnd);
-			break;
-		case '|': /* or */
-			build_simple_binop(l, LLVMOr);
-			break;
-		case '=': /* eq */
-			build_icmp_op(l, LLVMIntEQ);
-			break;
-		case '>': /* gt */
-			build_icmp_op(l, options.unsigned_mode?
-						LLVMIntUGT : LLVMIntSGT);
-			break;
-		case '_': /* neg */
-			store_stack(l, 0, LLVMBuildNeg(l->builder,
-						load_stack(l, 0), ""));
-			break;
-		case '~': /* not (bitwise) */
-			store_stack(l, 0, LLVMBuildNot(l->builder,
-						load_stack(l, 0), ""));
-			break;
-		case '$': /* dup */
-			push_stack(l, load_stack(l, 0));
-			break;
-		case '%': /* drop */
-			grow_stack(l, -1);
+		case '"': /* string */
+			parse_string(l);
 			break;
-		case '\\': /* swap */
-			{
-				/* a, b -> b, a */
-				LLVMValueRef a, b;
-				b = pop_stack(l);
-				a = pop_stack(l);
-				push_stack(l, b);
-				push_stack(l, a);
-			} break;
-		case '@': /* rotate */
-			{
-				/* a, b, c -> b, c, a */
-				LLVMValueRef a, b, c;
-				a = load_stack(l, 2);
-				b = load_stack(l, 1);
-				c = load_stack(l, 0);
-				store_stack(l, 2, b);
-				store_stack(l, 1, c);
-				store_stack(l, 0, a);
-			} break;
 		case 0xf8: /* ø in latin1 */
 			if (!options.decode_latin1)
 				goto default_label;
-			/* fall-through */
-		case 'O': /* pick (ø) */
-			/* Get the nth element of the stack, counted from the
-			   top, and push it. The zeroth element is the one just
-			   below the index, so "0ø" equals "$". */
-			{
-				LLVMValueRef index, value;
-
-				index = pop_stack(l);
-				value = LLVMBuildLoad(l->builder,
-						index_stack_by_value(l, index), "pick");
-				push_stack(l, value);
-			} break;
-		case '?': /* if */
-			build_if(l);
+			add_insn(l, OP_PICK);
 			break;
-		case '#': /* while */
-			build_while(l);
+		case 0xdf: /* ß in latin1 */
+			if (!options.decode_latin1)
+				goto default_label;
+			add_insn(l, OP_FLUSH);
 			break;
-		case '.': /* printnum */
-			{
-				/* TODO: consider options.unsigned_mode */
-				LLVMValueRef arg = pop_stack(l);
-				LLVMBuildCall(l->builder, l->env->func_printnum, &arg, 1, "");
-			} break;
-		case '"': /* string */
-			build_string(l);
+		case ':': case ';': case '+': case '-': case '*':
+		case '/': case '&': case '|': case '=': case '>': case '_':
+		case '~': case '$': case '%': case '\\': case '@': case 'O':
+		case '.': case ',': case '^': case 'B':
+			/* the opcodes of all other commands are their characters */
+			add_insn(l, ch);
 			break;
-		case ',': /* putc */
-			{
-				LLVMValueRef arg = pop_stack(l);
-				LLVMBuildCall(l->builder, l->env->func_putchar, &arg, 1, "");
-			} break;
-		case '^': /* getc */
-			{
-				LLVMValueRef res;
-
-				res = LLVMBuildCall(l->builder,
-						l->env->func_getchar, NULL, 0, "");
-				push_stack(l, res);
-			} break;
-		case 0xdf: /* ß in latin1 */
-			if (!options.decode_latin1)
-				goto default_label;
-			/* fall-through */
-		case 'B': /* flush (ß) */
-			LLVMBuildCall(l->builder, l->env->func_flush, NULL, 0, "");
+		case '?': case '#': case '!':
+			/* remember which lambda they're in, for --profile */
+			add_insn(l, ch)->u.site.lambda = l;
 			break;
 default_label: /* goto default; apparently doesn't work */
 		default:
@@ -655,25 +2393,555 @@ default_label: /* goto default; apparently doesn't work */
 		}
 	}
 
-	/* add a return intruction */
-	LLVMBuildRetVoid(l->builder);
+	peephole(l);
+}
+
+/*
+ * Stack effect analysis: For each lambda, find out how many items it takes
+ * from its caller's stack (pops), how many it leaves in their place (pushes),
+ * and how high the stack gets above the lowest point it reaches (max_depth),
+ * so "+" pops 2, pushes 1 and has a max_depth of 2. Calls, '?' and '#' are
+ * followed if the lambdas involved are known at compile time; if they're
+ * not, or if the effect depends on the data (e.g. a '?' whose body doesn't
+ * leave the stack as high as it was), the effect is dynamic.
+ */
+
+/* the state of the analysis within one lambda */
+struct effect_state {
+	int cur, min, max;	/* stack height, relative to the entry */
+	struct lambda **vals;	/* the known lambdas among our own items */
+	unsigned int len, size;
+	const char *dynamic;	/* why the effect is dynamic, or NULL */
+	struct lambda *var_lambda[26]; /* see scan_var_stores() */
+};
+
+static struct lambda *effect_pop(struct effect_state *st)
+{
+	st->cur--;
+	if (st->cur < st->min)
+		st->min = st->cur;
+	return st->len? st->vals[--st->len] : NULL;
+}
+
+static void effect_push(struct effect_state *st, struct lambda *lambda)
+{
+	if (st->len == st->size) {
+		st->size = st->size? 2 * st->size : 16;
+		st->vals = xrealloc(st->vals, st->size * sizeof(*st->vals));
+	}
+	st->vals[st->len++] = lambda;
+	st->cur++;
+	if (st->cur > st->max)
+		st->max = st->cur;
+}
+
+static void analyze_lambda(struct lambda *l);
+
+/* apply the effect of running callee, which may be NULL if it's unknown */
+static void effect_call(struct effect_state *st, struct lambda *callee)
+{
+	unsigned int i;
+
+	if (!callee) {
+		st->dynamic = "calls an unknown lambda";
+		return;
+	}
+
+	analyze_lambda(callee);
+	if (callee->effect.state == EFFECT_BUSY) {
+		st->dynamic = "is recursive";
+		return;
+	} else if (callee->effect.state == EFFECT_DYNAMIC) {
+		st->dynamic = "calls a lambda with a dynamic effect";
+		return;
+	}
+
+	for (i = 0; i < callee->effect.pops; i++)
+		effect_pop(st);
+	if (st->cur + (int) callee->effect.max_depth > st->max)
+		st->max = st->cur + callee->effect.max_depth;
+	for (i = 0; i < callee->effect.pushes; i++)
+		effect_push(st, NULL);
+}
+
+static void effect_insn(struct effect_state *st, struct insn *insn)
+{
+	struct lambda *a, *b, *c;
+	uint32_t n;
+
+	switch (insn->op) {
+	case OP_PUSH:
+	case OP_GETC:
+		effect_push(st, NULL);
+		break;
+	case OP_LAMBDA:
+		effect_push(st, insn->u.lambda);
+		break;
+	case OP_STRING:
+	case OP_FLUSH:
+		break;
+	case OP_STORE:
+		effect_pop(st);
+		effect_pop(st);
+		break;
+	case OP_STORE_VAR:
+		effect_pop(st);
+		break;
+	case OP_LOAD:
+		effect_pop(st);
+		effect_push(st, NULL);
+		break;
+	case OP_LOAD_VAR:
+		effect_push(st, st->var_lambda[insn->u.value]);
+		break;
+	case OP_CALL:
+		effect_call(st, effect_pop(st));
+		break;
+	case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+	case OP_AND: case OP_OR: case OP_EQ: case OP_GT:
+		effect_pop(st);
+		effect_pop(st);
+		effect_push(st, NULL);
+		break;
+	case OP_NEG:
+	case OP_NOT:
+	case OP_ADD_CONST:
+		effect_pop(st);
+		effect_push(st, NULL);
+		break;
+	case OP_DUP:
+		a = effect_pop(st);
+		effect_push(st, a);
+		effect_push(st, a);
+		break;
+	case OP_DROP:
+	case OP_PRINTNUM:
+	case OP_PUTC:
+		effect_pop(st);
+		break;
+	case OP_SWAP:
+		b = effect_pop(st);
+		a = effect_pop(st);
+		effect_push(st, b);
+		effect_push(st, a);
+		break;
+	case OP_ROT:
+		c = effect_pop(st);
+		b = effect_pop(st);
+		a = effect_pop(st);
+		effect_push(st, b);
+		effect_push(st, c);
+		effect_push(st, a);
+		break;
+	case OP_PICK:
+		effect_pop(st);
+		effect_push(st, NULL);
+		break;
+	case OP_PICK_CONST:
+		n = insn->u.value;
+		/* the item that is read must be there */
+		if (n < (uint32_t) INT_MAX && st->cur - (int) n - 1 < st->min)
+			st->min = st->cur - (int) n - 1;
+		effect_push(st, n < st->len? st->vals[st->len - 1 - n] : NULL);
+		break;
+	case OP_IF:
+		a = effect_pop(st);
+		effect_pop(st);
+		if (a) {
+			analyze_lambda(a);
+			if (a->effect.state == EFFECT_FIXED &&
+			    a->effect.pops != a->effect.pushes) {
+				st->dynamic = "has a '?' whose body is unbalanced";
+				break;
+			}
+		}
+		effect_call(st, a);
+		break;
+	case OP_WHILE:
+		{
+			int start;
+
+			b = effect_pop(st);
+			a = effect_pop(st);
+			start = st->cur;
+
+			/* one iteration must leave the stack as it was */
+			effect_call(st, a);
+			effect_pop(st);
+			effect_call(st, b);
+			if (!st->dynamic && st->cur != start) {
+				st->dynamic = "has a '#' loop that changes the stack height";
+				break;
+			}
+
+			/* the last condition */
+			effect_call(st, a);
+			effect_pop(st);
+		} break;
+	}
+}
+
+/* compute l->effect, unless that's already done */
+static void analyze_lambda(struct lambda *l)
+{
+	struct effect_state st;
+	unsigned int i;
+
+	if (l->effect.state != EFFECT_UNKNOWN)
+		return;
+	l->effect.state = EFFECT_BUSY;
+
+	memset(&st, 0, sizeof(st));
+	memcpy(st.var_lambda, l->env->effect_var_lambda, sizeof(st.var_lambda));
+	for (i = 0; i < l->n_code && !st.dynamic; i++)
+		effect_insn(&st, &l->code[i]);
+	free(st.vals);
+
+	if (st.dynamic) {
+		l->effect.state = EFFECT_DYNAMIC;
+		l->effect.dynamic = st.dynamic;
+	} else {
+		l->effect.state = EFFECT_FIXED;
+		l->effect.pops = -st.min;
+		l->effect.pushes = st.cur - st.min;
+		l->effect.max_depth = st.max - st.min;
+	}
+}
+
+/*
+ * Find the variables that only ever hold one particular lambda, because the
+ * only stores to them are of the form "[...]v:". Any other store to a
+ * variable, or one to a computed variable reference, spoils it.
+ */
+static void scan_var_stores(struct environment *env)
+{
+	bool clobbered[26] = { false };
+	struct lambda *l, **known = env->effect_var_lambda;
+	struct insn *code;
+	unsigned int i, j;
+	int var;
+
+	for (j = 0; j < env->n_lambdas; j++) {
+		l = env->lambdas[j];
+		code = l->code;
+		for (i = 0; i < l->n_code; i++) {
+			if (code[i].op == OP_STORE) {
+				memset(clobbered, true, sizeof(clobbered));
+				continue;
+			} else if (code[i].op != OP_STORE_VAR) {
+				continue;
+			}
+
+			var = code[i].u.value;
+			if (i == 0 || code[i - 1].op != OP_LAMBDA ||
+			    (known[var] && known[var] != code[i - 1].u.lambda))
+				clobbered[var] = true;
+			else
+				known[var] = code[i - 1].u.lambda;
+		}
+	}
+
+	for (var = 0; var < 26; var++)
+		if (clobbered[var])
+			known[var] = NULL;
+}
+
+static void analyze_program(struct environment *env)
+{
+	struct lambda *l;
+	struct stack_effect *e;
+	unsigned int i, line, column;
+
+	scan_var_stores(env);
+	for (i = 0; i < env->n_lambdas; i++)
+		analyze_lambda(env->lambdas[i]);
+
+	if (!options.report_effects)
+		return;
+
+	for (i = 0; i < env->n_lambdas; i++) {
+		l = env->lambdas[i];
+		e = &l->effect;
+		source_position(env, l->start, &line, &column);
+		fprintf(stderr, "%s:%u:%u: lambda %u: ", env->file,
+				line, column, l->id);
+		if (e->state == EFFECT_DYNAMIC)
+			fprintf(stderr, "dynamic stack effect, it %s\n", e->dynamic);
+		else
+			fprintf(stderr, "pops %u, pushes %u, max depth %u%s\n",
+					e->pops, e->pushes, e->max_depth,
+					e->pops != e->pushes? " (unbalanced)" : "");
+	}
+}
+
+/* ':', with the reference already popped. stack: val -> (nothing) */
+static void build_store(struct lambda *l, LLVMValueRef ref)
+{
+	struct stack_value val = pop_stack_value(l);
+
+	store_var(l, ref, val.value);
+	note_var_store(l, ref, val.lambda);
+}
+
+/* ';', with the reference already popped. stack: (nothing) -> val */
+static void build_load(struct lambda *l, LLVMValueRef ref)
+{
+	struct stack_value val = { NULL, NULL, -1 };
+
+	val.value = load_var(l, ref);
+	val.var = const_var_ref(ref);
+	if (val.var >= 0)
+		val.lambda = l->var_lambda[val.var];
+	push_stack_value(l, val);
+}
+
+static void gen_insn(struct lambda *l, struct insn *insn)
+{
+	switch (insn->op) {
+	case OP_PUSH:
+		push_stack(l, u32_value(insn->u.value));
+		break;
+	case OP_LAMBDA:
+		{
+			struct stack_value sv = {
+				u32_value(insn->u.lambda->id), insn->u.lambda, -1
+			};
+			push_stack_value(l, sv);
+		} break;
+	case OP_STRING:
+		build_string(l, insn);
+		break;
+	case OP_STORE:
+		build_store(l, pop_stack(l));
+		break;
+	case OP_STORE_VAR:
+		build_store(l, u32_value(insn->u.value));
+		break;
+	case OP_LOAD:
+		build_load(l, pop_stack(l));
+		break;
+	case OP_LOAD_VAR:
+		build_load(l, u32_value(insn->u.value));
+		break;
+	case OP_CALL:
+		/* lambdas are stored on the stack as 32-bit indices to a
+		   global array that contains pointers to the actual
+		   functions */
+		build_call(l, insn);
+		break;
+	case OP_ADD:
+		build_simple_binop(l, LLVMAdd);
+		break;
+	case OP_SUB:
+		build_simple_binop(l, LLVMSub);
+		break;
+	case OP_ADD_CONST:
+		store_stack(l, 0, LLVMBuildAdd(l->builder, load_stack(l, 0),
+					u32_value(insn->u.value), ""));
+		break;
+	case OP_MUL:
+		build_simple_binop(l, LLVMMul);
+		break;
+	case OP_DIV:
+		build_simple_binop(l, options.unsigned_mode?
+					LLVMUDiv : LLVMSDiv);
+		break;
+	case OP_AND:
+		build_simple_binop(l, LLVMAnd);
+		break;
+	case OP_OR:
+		build_simple_binop(l, LLVMOr);
+		break;
+	case OP_EQ:
+		build_icmp_op(l, LLVMIntEQ);
+		break;
+	case OP_GT:
+		build_icmp_op(l, options.unsigned_mode?
+					LLVMIntUGT : LLVMIntSGT);
+		break;
+	case OP_NEG:
+		store_stack(l, 0, LLVMBuildNeg(l->builder,
+					load_stack(l, 0), ""));
+		break;
+	case OP_NOT: /* bitwise */
+		store_stack(l, 0, LLVMBuildNot(l->builder,
+					load_stack(l, 0), ""));
+		break;
+	case OP_DUP:
+		push_stack_value(l, *peek_stack(l, 0));
+		break;
+	case OP_DROP:
+		drop_stack(l);
+		break;
+	case OP_SWAP:
+		{
+			/* a, b -> b, a */
+			struct stack_value a, b;
+			b = pop_stack_value(l);
+			a = pop_stack_value(l);
+			push_stack_value(l, b);
+			push_stack_value(l, a);
+		} break;
+	case OP_ROT:
+		{
+			/* a, b, c -> b, c, a */
+			struct stack_value a;
+			a = *peek_stack(l, 2);
+			*peek_stack(l, 2) = *peek_stack(l, 1);
+			*peek_stack(l, 1) = *peek_stack(l, 0);
+			*peek_stack(l, 0) = a;
+		} break;
+	case OP_PICK: /* ø */
+		/* Get the nth element of the stack, counted from the top, and
+		   push it. The zeroth element is the one just below the index,
+		   so "0ø" equals "$". */
+		{
+			LLVMValueRef index, value;
+
+			index = pop_stack(l);
+			if (LLVMIsAConstantInt(index) &&
+			    LLVMConstIntGetZExtValue(index) < l->vs_len) {
+				push_stack_value(l, *peek_stack(l,
+					LLVMConstIntGetZExtValue(index)));
+				break;
+			}
+
+			spill_stack(l);
+			value = LLVMBuildLoad2(l->builder, LLVMInt32Type(),
+					index_stack_by_value(l, index), "pick");
+			push_stack(l, value);
+		} break;
+	case OP_PICK_CONST:
+		{
+			uint32_t n = insn->u.value;
+
+			if (n < l->vs_len) {
+				push_stack_value(l, *peek_stack(l, n));
+				break;
+			}
+
+			/* the element is in memory, below the virtual stack */
+			push_stack(l, LLVMBuildLoad2(l->builder,
+					LLVMInt32Type(),
+					index_stack(l, n - l->vs_len), "pick"));
+		} break;
+	case OP_IF:
+		build_if(l, insn);
+		break;
+	case OP_WHILE:
+		build_while(l, insn);
+		break;
+	case OP_PRINTNUM:
+		{
+			LLVMValueRef arg = pop_stack(l);
+			build_fn_call(l->builder, options.unsigned_mode?
+					l->env->func_printunum :
+					l->env->func_printnum, &arg, 1, "");
+		} break;
+	case OP_PUTC:
+		{
+			LLVMValueRef arg = pop_stack(l);
+			build_fn_call(l->builder, l->env->func_putchar, &arg, 1, "");
+		} break;
+	case OP_GETC:
+		{
+			LLVMValueRef res;
+
+			res = build_fn_call(l->builder,
+					l->env->func_getchar, NULL, 0, "");
+			push_stack(l, res);
+		} break;
+	case OP_FLUSH: /* ß */
+		build_fn_call(l->builder, l->env->func_flush, NULL, 0, "");
+		break;
+	}
+}
+
+/* generate the code of src into l's function */
+static void gen_code(struct lambda *l, struct lambda *src)
+{
+	unsigned int i;
+	bool tail = l->tail;
+
+	for (i = 0; i < src->n_code; i++) {
+		set_debug_location(l, src->code[i].line, src->code[i].column);
+		l->tail = tail && i == src->n_code - 1;
+		gen_insn(l, &src->code[i]);
+	}
+	l->tail = tail;
+}
+
+/* generate the function of a parsed lambda */
+static void gen_lambda(struct lambda *l)
+{
+	/* the builder and the virtual stack's memory are reused for all
+	   lambdas */
+	l->builder = l->env->builder;
+	l->vs = l->env->vs;
+	l->vs_size = l->env->vs_size;
+	l->vs_len = 0;
+
+	LLVMPositionBuilderAtEnd(l->builder, LLVMAppendBasicBlock(l->fn, ""));
+	l->n_bb = 1;
+	/* the stack never moves once main has set it up */
+	l->stack = build_load_global(l->builder, l->env->var_stack, "stack");
+	l->sp = NULL;
+	l->sp_dirty = false;
+	forget_vars(l);
+
+	begin_debug_info(l);
+	count_event(l, l->profile_base);
+	l->start_cycles = NULL;
+	if (options.profile == PROFILE_CYCLES)
+		l->start_cycles = build_fn_call(l->builder,
+				l->env->func_readcyclecounter, NULL, 0, "start");
+
+	l->tail = true;
+	l->inlining = true;
+	l->inline_size = 0;
+	gen_code(l, l);
+	l->inlining = false;
+	l->tail = false;
+
+	build_return(l, ends_in_call(l));
+	set_entry_count(l);
+	if (options.debug_info)
+		LLVMSetCurrentDebugLocation2(l->builder, NULL);
 
-	/* we don't need the builder anymore */
-	LLVMDisposeBuilder(l->builder);
 	l->builder = NULL;
-	l->bb = NULL;
+	l->env->vs = l->vs;
+	l->env->vs_size = l->vs_size;
+	l->vs = NULL;
+	l->vs_len = l->vs_size = 0;
+}
+
+/* define a global that holds the state of the program, which is 0 at first.
+   With --tiered, it is only declared: it's the interpreter's, see
+   tier_symbols(). */
+static LLVMValueRef add_state_global(struct environment *env, LLVMTypeRef t,
+		const char *name)
+{
+	LLVMValueRef global = LLVMAddGlobal(env->module, t, name);
+
+	if (!options.tiered) {
+		set_linkage(global, LINKAGE_DATA);
+		LLVMSetInitializer(global, LLVMConstNull(t));
+	}
+	return global;
 }
 
 /* build the libfalse interface etc. */
 static void prepare_env(struct environment *env)
 {
-	LLVMTypeRef voidt, i32t, strt, strpt, intt, lambdappt;
+	LLVMTypeRef voidt, i32t, i32pt, strt, strpt, intt, lambdappt;
 	LLVMTypeRef fnt_void_i32, fnt_void_str, fnt_i32_void, fnt_void_void;
-	LLVMTypeRef fnt_main, parm_main[2];
-	LLVMTypeRef art_vars, art_stack;
+	LLVMTypeRef fnt_main, parm_main[2], parm_run[2], parm_stack_init[4];
+	char name[sizeof("var_x")];
+	int i;
 
 	voidt = LLVMVoidType();
 	i32t = LLVMInt32Type(); /* LLVM doesn't have signedness at this level */
+	i32pt = LLVMPointerType(i32t, 0);
 	strt = LLVMPointerType(LLVMInt8Type(), 0); /* no const, either (?) */
 	strpt = LLVMPointerType(strt, 0); /* (char **) */
 
@@ -682,33 +2950,38 @@ static void prepare_env(struct environment *env)
 	fnt_i32_void = LLVMFunctionType(i32t, NULL, 0, false);
 	fnt_void_void = LLVMFunctionType(voidt, NULL, 0, false);
 
-	/* define uint32_t vars[26]; */
-	art_vars = LLVMArrayType(i32t, 26);
-	env->var_vars = LLVMAddGlobal(env->module, art_vars, "vars");
-	set_linkage(env->var_vars, LINKAGE_DATA);
-	LLVMSetInitializer(env->var_vars, LLVMConstNull(art_vars));
+	env->builder = LLVMCreateBuilder();
+
+	/* define uint32_t var_a, ..., var_z; */
+	for (i = 0; i < 26; i++) {
+		snprintf(name, sizeof(name), "var_%c", 'a' + i);
+		env->var_var[i] = add_state_global(env, i32t, name);
+	}
 
-	/* define uint32_t stack[STACKSIZE]; */
-	art_stack = LLVMArrayType(i32t, options.stack_size);
-	env->var_stack = LLVMAddGlobal(env->module, art_stack, "stack");
-	set_linkage(env->var_stack, LINKAGE_DATA);
-	LLVMSetInitializer(env->var_stack, LLVMConstNull(art_stack));
+	/* define uint32_t *stack; (set up by lf_stack_init) */
+	env->var_stack = add_state_global(env, i32pt, "stack");
 
 	/* define uint32_t stack_index; */
-	env->var_stackidx = LLVMAddGlobal(env->module, i32t, "stack_index");
-	set_linkage(env->var_stackidx, LINKAGE_DATA);
-	LLVMSetInitializer(env->var_stackidx, LLVMConstNull(i32t));
+	env->var_stackidx = add_state_global(env, i32t, "stack_index");
 
 	/* typedef void (*lambda_t)(void); */
 	env->lambda_type = fnt_void_void;
 
-	/* declare lambda_t lambdas[]; */
-	lambdappt = LLVMPointerType(LLVMPointerType(env->lambda_type, 0), 0);
-	env->var_lambdas = LLVMAddGlobal(env->module, lambdappt, "lambdas");
-	set_linkage(env->var_lambdas, LINKAGE_CONST_DATA);
+	/* declare lambda_t lambdas[]; --tiered calls through tier_call()
+	   instead, see build_indirect_call() */
+	if (options.tiered) {
+		env->func_tier_call = LLVMAddFunction(env->module, "tier_call",
+				fnt_void_i32);
+	} else {
+		lambdappt = LLVMPointerType(LLVMPointerType(env->lambda_type, 0), 0);
+		env->var_lambdas = LLVMAddGlobal(env->module, lambdappt, "lambdas");
+		set_linkage(env->var_lambdas, LINKAGE_CONST_DATA);
+	}
 
 	/* extern void lf_printnum(uint32_t i); */
 	env->func_printnum = LLVMAddFunction(env->module, "lf_printnum", fnt_void_i32);
+	/* extern void lf_printunum(uint32_t i); */
+	env->func_printunum = LLVMAddFunction(env->module, "lf_printunum", fnt_void_i32);
 	/* extern void lf_printstring(const char *str); */
 	env->func_printstring = LLVMAddFunction(env->module, "lf_printstring", fnt_void_str);
 	/* extern void lf_putchar(uint32_t ch); */
@@ -717,6 +2990,20 @@ static void prepare_env(struct environment *env)
 	env->func_getchar = LLVMAddFunction(env->module, "lf_getchar", fnt_i32_void);
 	/* extern void lf_flush(void); */
 	env->func_flush = LLVMAddFunction(env->module, "lf_flush", fnt_void_void);
+	/* extern void lf_run(lambda_t fn, uint64_t stack_size); */
+	parm_run[0] = LLVMPointerType(env->lambda_type, 0);
+	parm_run[1] = LLVMInt64Type();
+	env->func_run = LLVMAddFunction(env->module, "lf_run",
+			LLVMFunctionType(voidt, parm_run, 2, false));
+
+	/* extern uint32_t *lf_stack_init(uint32_t size, const lambda_t *lambdas,
+			const uint32_t *lambda_pos, uint32_t n_lambdas); */
+	parm_stack_init[0] = i32t;
+	parm_stack_init[1] = LLVMPointerType(parm_run[0], 0);
+	parm_stack_init[2] = i32pt;
+	parm_stack_init[3] = i32t;
+	env->func_stack_init = LLVMAddFunction(env->module, "lf_stack_init",
+			LLVMFunctionType(i32pt, parm_stack_init, 4, false));
 
 	/* int main(int argc, char **argv); */
 	intt = LLVMIntType(options.int_width);
@@ -746,103 +3033,2291 @@ static void prepare_env(struct environment *env)
  */
 static void fill_lambdas(struct environment *env)
 {
-	LLVMValueRef *values, array_const, anon_global, gep_ptr, indices[2];
-	unsigned num;
-	struct lambda *tmp;
+	LLVMValueRef *values, array_const, global, gep_ptr, indices[2];
+	unsigned num = env->n_lambdas, i, line, column;
 
 	/* collect all lambda function values */
-	num = env->last_lambda->id + 1;
 	values = xmalloc(num * sizeof(*values));
-	for (tmp = env->last_lambda; tmp; tmp = tmp->prev)
-		values[tmp->id] = tmp->fn;
+	for (i = 0; i < num; i++)
+		values[i] = env->lambdas[i]->fn;
 
-	/* make an array constant and initialize an anonymous global with it */
+	/* make an array constant and initialize a global with it */
 	array_const = LLVMConstArray(LLVMPointerType(env->lambda_type,0), values, num);
 	free(values);
-	anon_global = LLVMAddGlobal(env->module, LLVMTypeOf(array_const), "");
-	set_linkage(anon_global, LINKAGE_CONST_DATA);
-	LLVMSetInitializer(anon_global, array_const);
+	global = LLVMAddGlobal(env->module, LLVMTypeOf(array_const),
+			"lambda_table");
+	set_linkage(global, LINKAGE_CONST_DATA);
+	LLVMSetInitializer(global, array_const);
 
 	/* make the "lambdas" global point to the array */
 	indices[1] = indices[0] = u32_value(0);
-	gep_ptr = LLVMConstInBoundsGEP(anon_global, indices, 2);
+	gep_ptr = LLVMConstInBoundsGEP2(LLVMGlobalGetValueType(global), global,
+			indices, 2);
 	LLVMSetInitializer(env->var_lambdas, gep_ptr);
+
+	/* the source position of each lambda, for lf_stack_init */
+	values = xmalloc(2 * num * sizeof(*values));
+	for (i = 0; i < num; i++) {
+		source_position(env, env->lambdas[i]->start, &line, &column);
+		values[2 * i] = u32_value(line);
+		values[2 * i + 1] = u32_value(column);
+	}
+	array_const = LLVMConstArray(LLVMInt32Type(), values, 2 * num);
+	free(values);
+	global = LLVMAddGlobal(env->module, LLVMTypeOf(array_const),
+			"lambda_pos");
+	set_linkage(global, LINKAGE_CONST_DATA);
+	LLVMSetInitializer(global, array_const);
+	env->var_lambda_pos = LLVMConstInBoundsGEP2(
+			LLVMGlobalGetValueType(global), global, indices, 2);
+}
+
+/*
+ * Build the bodies of the call_<var> functions, see build_dispatch(). If
+ * only one lambda is ever stored in a variable, the variable can only hold
+ * that lambda or 0, and the dispatcher calls it directly. --tiered only
+ * generates code for some lambdas, so it goes by what scan_var_stores()
+ * found in all of them.
+ */
+static void build_var_dispatchers(struct environment *env)
+{
+	struct lambda *known;
+	int var;
+
+	for (var = 0; var < 26; var++) {
+		if (!env->call_var[var])
+			continue;
+
+		known = env->stored_lambda[var];
+		if (env->var_clobbered[var] || env->dynamic_store)
+			known = NULL;
+		if (options.tiered)
+			known = env->effect_var_lambda[var];
+		build_dispatch(env, env->call_var[var], known);
+	}
+}
+
+/*
+ * Build the bodies of load_var and store_var, which access variables through
+ * references that aren't known at compile time:
+ *
+ *   load_var(ref):
+ *     switch ref: case 0: ret var_a; ...; default: ret 0
+ *
+ * References outside of a-z read as 0, and stores to them are ignored.
+ */
+static void build_var_accessors(struct environment *env)
+{
+	LLVMBuilderRef builder;
+	LLVMValueRef sw;
+	LLVMBasicBlockRef default_bb, bb;
+	int var;
+
+	builder = env->builder;
+
+	if (env->func_load_var) {
+		LLVMPositionBuilderAtEnd(builder,
+				LLVMAppendBasicBlock(env->func_load_var, ""));
+		default_bb = LLVMAppendBasicBlock(env->func_load_var, "default");
+		sw = LLVMBuildSwitch(builder, LLVMGetParam(env->func_load_var, 0),
+				default_bb, 26);
+		for (var = 0; var < 26; var++) {
+			bb = LLVMAppendBasicBlock(env->func_load_var, "");
+			LLVMAddCase(sw, u32_value(var), bb);
+			LLVMPositionBuilderAtEnd(builder, bb);
+			LLVMBuildRet(builder, build_load_global(builder,
+						env->var_var[var], ""));
+		}
+		LLVMPositionBuilderAtEnd(builder, default_bb);
+		LLVMBuildRet(builder, u32_value(0));
+	}
+
+	if (env->func_store_var) {
+		LLVMPositionBuilderAtEnd(builder,
+				LLVMAppendBasicBlock(env->func_store_var, ""));
+		default_bb = LLVMAppendBasicBlock(env->func_store_var, "default");
+		sw = LLVMBuildSwitch(builder, LLVMGetParam(env->func_store_var, 0),
+				default_bb, 26);
+		for (var = 0; var < 26; var++) {
+			bb = LLVMAppendBasicBlock(env->func_store_var, "");
+			LLVMAddCase(sw, u32_value(var), bb);
+			LLVMPositionBuilderAtEnd(builder, bb);
+			LLVMBuildStore(builder,
+					LLVMGetParam(env->func_store_var, 1),
+					env->var_var[var]);
+			LLVMBuildRetVoid(builder);
+		}
+		LLVMPositionBuilderAtEnd(builder, default_bb);
+		LLVMBuildRetVoid(builder);
+	}
 }
 
 static void finish_env(struct environment *env)
 {
 	LLVMBuilderRef builder;
 	LLVMBasicBlockRef main_bb;
+	LLVMValueRef init_args[4];
 	LLVMTypeRef intt;
 
 	fill_lambdas(env);
+	build_var_dispatchers(env);
+	build_var_accessors(env);
 
 	/* build main */
-	builder = LLVMCreateBuilder();
+	builder = env->builder;
 	main_bb = LLVMAppendBasicBlock(env->func_main, "");
 	LLVMPositionBuilderAtEnd(builder, main_bb);
 
-	LLVMBuildCall(builder, env->func_lambda_0, NULL, 0, "");
+	/* stack = lf_stack_init(STACKSIZE, lambdas, lambda_pos, n); */
+	init_args[0] = u32_value(options.stack_size);
+	init_args[1] = build_load_global(builder, env->var_lambdas, "");
+	init_args[2] = env->var_lambda_pos;
+	init_args[3] = u32_value(env->n_lambdas);
+	LLVMBuildStore(builder, build_fn_call(builder, env->func_stack_init,
+				init_args, 4, ""), env->var_stack);
+
+	if (options.native_stack) {
+		LLVMValueRef args[2] = {
+			env->func_lambda_0,
+			LLVMConstInt(LLVMInt64Type(), options.native_stack, false),
+		};
+
+		build_fn_call(builder, env->func_run, args, 2, "");
+	} else {
+		build_fn_call(builder, env->func_lambda_0, NULL, 0, "");
+	}
+	build_fn_call(builder, env->func_flush, NULL, 0, "");
+
+	if (options.profile) {
+		/* lf_profile_write(profile_counters, profile_keys, n); */
+		LLVMValueRef args[3], indices[2];
+
+		indices[1] = indices[0] = u32_value(0);
+		args[0] = LLVMConstInBoundsGEP2(
+				LLVMGlobalGetValueType(env->var_profile),
+				env->var_profile, indices, 2);
+		args[1] = env->profile_keys;
+		args[2] = u32_value(env->n_profile);
+		build_fn_call(builder, env->func_profile_write, args, 3, "");
+	}
+
 	intt = LLVMIntType(options.int_width);
 	LLVMBuildRet(builder, LLVMConstNull(intt));
+}
+
+/*
+ * Link the bitcode of libfalse into the module. The runtime functions become
+ * internal, so that LLVM can inline them into the generated code (and drop
+ * them if they aren't used).
+ */
+static void link_runtime(LLVMModuleRef module, const char *file)
+{
+	LLVMMemoryBufferRef buf;
+	LLVMModuleRef runtime;
+	LLVMValueRef fn;
+	char *msg;
+
+	if (LLVMCreateMemoryBufferWithContentsOfFile(file, &buf, &msg)) {
+		fprintf(stderr, "error: Can't read '%s': %s\n", file, msg);
+		exit(EXIT_FAILURE);
+	}
+	if (LLVMParseBitcode2(buf, &runtime)) {
+		fprintf(stderr, "error: '%s' isn't a valid bitcode file\n", file);
+		exit(EXIT_FAILURE);
+	}
+	LLVMDisposeMemoryBuffer(buf);
+
+	/* the runtime has been compiled for the same target, hopefully */
+	LLVMSetTarget(runtime, LLVMGetTarget(module));
+	LLVMSetDataLayout(runtime, LLVMGetDataLayoutStr(module));
+
+	if (LLVMLinkModules2(module, runtime)) {
+		fprintf(stderr, "error: Can't link '%s' into the program\n", file);
+		exit(EXIT_FAILURE);
+	}
+
+	for (fn = LLVMGetFirstFunction(module); fn; fn = LLVMGetNextFunction(fn)) {
+		const char *name = LLVMGetValueName(fn);
 
-	LLVMDisposeBuilder(builder);
+		if (!LLVMIsDeclaration(fn) && !strncmp(name, "lf_", 3))
+			LLVMSetLinkage(fn, LLVMInternalLinkage);
+	}
 }
 
-static void compile_file(const char *infile, const char *outfile)
+/* run LLVM's optimization pipeline for the selected level on the module */
+static void optimize_module(LLVMModuleRef module, LLVMTargetMachineRef tm)
 {
-	struct environment env;
-	FILE *infp, *outfp;
-	struct lambda *main_l;
+	LLVMPassBuilderOptionsRef pbo;
+	LLVMErrorRef err;
+	char pipeline[sizeof("default<Ox>")];
+	bool vectorize;
+
+	if (options.opt_level == '0')
+		return;
+
+	snprintf(pipeline, sizeof(pipeline), "default<O%c>", options.opt_level);
+	vectorize = options.opt_level != '1';
+
+	pbo = LLVMCreatePassBuilderOptions();
+	LLVMPassBuilderOptionsSetLoopVectorization(pbo, vectorize);
+	LLVMPassBuilderOptionsSetSLPVectorization(pbo, vectorize);
+
+	err = LLVMRunPasses(module, pipeline, tm, pbo);
+	if (err) {
+		char *msg = LLVMGetErrorMessage(err);
+		fprintf(stderr, "error: optimization failed: %s\n", msg);
+		LLVMDisposeErrorMessage(msg);
+		exit(EXIT_FAILURE);
+	}
 
-	/* open files */
-	if (infile) {
-		infp = xfopen(infile, "r");
+	LLVMDisposePassBuilderOptions(pbo);
+}
+
+/* the target triple, CPU and features selected by the options; the strings
+   must be freed with LLVMDisposeMessage */
+static void get_target(char **triple, char **cpu, char **features)
+{
+	if (options.triple)
+		*triple = LLVMNormalizeTargetTriple(options.triple);
+	else
+		*triple = LLVMGetDefaultTargetTriple();
+
+	if (options.cpu && !strcmp(options.cpu, "native")) {
+		*cpu = LLVMGetHostCPUName();
+		/* use the features of the host unless told otherwise */
+		*features = options.features? LLVMCreateMessage(options.features) :
+			LLVMGetHostCPUFeatures();
 	} else {
-		infp = stdin;
-		infile = "<stdin>";
+		*cpu = LLVMCreateMessage(options.cpu? options.cpu : "generic");
+		*features = LLVMCreateMessage(options.features? options.features : "");
+	}
+}
+
+/* create a target machine according to the options and set up the module
+   to use it */
+static LLVMTargetMachineRef create_target_machine(LLVMModuleRef module)
+{
+	LLVMTargetRef target;
+	LLVMTargetMachineRef tm;
+	LLVMCodeGenOptLevel level;
+	LLVMTargetDataRef layout;
+	char *triple, *cpu, *features, *layout_str, *msg;
+
+	get_target(&triple, &cpu, &features);
+	if (LLVMGetTargetFromTriple(triple, &target, &msg)) {
+		fprintf(stderr, "error: %s\n", msg);
+		exit(EXIT_FAILURE);
+	}
+
+	switch (options.opt_level) {
+	case '0': level = LLVMCodeGenLevelNone; break;
+	case '1': level = LLVMCodeGenLevelLess; break;
+	case '3': level = LLVMCodeGenLevelAggressive; break;
+	default:  level = LLVMCodeGenLevelDefault; break;
+	}
+
+	tm = LLVMCreateTargetMachine(target, triple, cpu, features, level,
+			LLVMRelocPIC, LLVMCodeModelDefault);
+
+	LLVMSetTarget(module, triple);
+	layout = LLVMCreateTargetDataLayout(tm);
+	layout_str = LLVMCopyStringRepOfTargetData(layout);
+	LLVMSetDataLayout(module, layout_str);
+	LLVMDisposeMessage(layout_str);
+	LLVMDisposeTargetData(layout);
+
+	LLVMDisposeMessage(triple);
+	LLVMDisposeMessage(cpu);
+	LLVMDisposeMessage(features);
+
+	return tm;
+}
+
+static void write_memory_buffer(LLVMMemoryBufferRef buf, FILE *outfp,
+		const char *outfile)
+{
+	size_t size = LLVMGetBufferSize(buf);
+
+	if (fwrite(LLVMGetBufferStart(buf), 1, size, outfp) != size ||
+	    fflush(outfp)) {
+		fprintf(stderr, "error: Can't write '%s': %s\n", outfile,
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* run the C compiler with the arguments in argv, which produces outfile */
+static void run_cc(const char **argv, const char *outfile)
+{
+	const char *cc;
+	int status;
+	pid_t pid;
+
+	cc = getenv("CC");
+	if (!cc || !*cc)
+		cc = "cc";
+	argv[0] = cc;
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "error: Can't fork: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	} else if (pid == 0) {
+		execvp(cc, (char **) argv);
+		fprintf(stderr, "error: Can't run '%s': %s\n", cc, strerror(errno));
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "error: linking '%s' failed\n", outfile);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* run "cc OBJECTS -lfalse -o OUTFILE", or similar */
+static void link_executable(char *const *objects, unsigned int n,
+		const char *outfile)
+{
+	const char **argv;
+	char *libarg = NULL, *rpatharg = NULL;
+	unsigned int argc = 1, i;
+
+	argv = xmalloc((n + 16) * sizeof(*argv));
+	for (i = 0; i < n; i++)
+		argv[argc++] = objects[i];
+	if (options.libdir && !options.runtime) {
+		libarg = xmalloc(strlen(options.libdir) + sizeof("-L"));
+		sprintf(libarg, "-L%s", options.libdir);
+		argv[argc++] = libarg;
+		if (!options.static_runtime) {
+			rpatharg = xmalloc(strlen(options.libdir) +
+					sizeof("-Wl,-rpath,"));
+			sprintf(rpatharg, "-Wl,-rpath,%s", options.libdir);
+			argv[argc++] = rpatharg;
+		}
+	}
+	/* with --runtime, libfalse is part of the object file already */
+	if (!options.runtime)
+		argv[argc++] = options.static_runtime? "-l:libfalse.a" : "-lfalse";
+	argv[argc++] = "-pthread"; /* for lf_run */
+	argv[argc++] = "-o";
+	argv[argc++] = outfile;
+	argv[argc] = NULL;
+
+	run_cc(argv, outfile);
+
+	free(argv);
+	free(libarg);
+	free(rpatharg);
+}
+
+/* create a temporary file; tmpname is a template like "/tmp/llfalse-XXXXXX" */
+static FILE *create_temp_file(char *tmpname)
+{
+	int fd;
+
+	FILE *fp;
+
+	fd = mkstemp(tmpname);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		fprintf(stderr, "error: Can't create a temporary file: %s\n",
+				strerror(errno));
+		exit(EXIT_FAILURE);
 	}
-	if (outfile) {
-		outfp = xfopen(outfile, "w");
+	return fp;
+}
+
+/* compile the module to the requested format; this is an object file for
+   --emit=exe and --run */
+static LLVMMemoryBufferRef emit_module(LLVMModuleRef module,
+		LLVMTargetMachineRef tm)
+{
+	LLVMMemoryBufferRef buf;
+	char *msg;
+
+	if (!options.run && options.emit == EMIT_BITCODE)
+		return LLVMWriteBitcodeToMemoryBuffer(module);
+
+	if (!options.run && options.emit == EMIT_IR) {
+		msg = LLVMPrintModuleToString(module);
+		buf = LLVMCreateMemoryBufferWithMemoryRangeCopy(msg, strlen(msg), "");
+		LLVMDisposeMessage(msg);
+		return buf;
+	}
+
+	if (LLVMTargetMachineEmitToMemoryBuffer(tm, module,
+			options.emit == EMIT_ASM && !options.run?
+			LLVMAssemblyFile : LLVMObjectFile, &msg, &buf)) {
+		fprintf(stderr, "error: code generation failed: %s\n", msg);
+		exit(EXIT_FAILURE);
+	}
+	return buf;
+}
+
+/*
+ * Parallel code generation. Big programs are split into partitions of
+ * consecutive lambdas, which are optimized and compiled to object files on
+ * a thread each. Every thread parses the whole module from bitcode into an
+ * LLVM context of its own and then turns what it doesn't own into
+ * declarations: the lambdas of the other partitions, and everything else
+ * except in partition 0. Strings are copied into each partition that uses
+ * them. The objects are linked together at the end.
+ *
+ * Calls across partitions can't be inlined, which is why small programs
+ * are compiled in one piece unless -j says otherwise.
+ */
+#define MIN_PARTITION_CODE 20000 /* instructions */
+
+struct partition {
+	unsigned int index;
+	unsigned int first, end;	/* the ids of its lambdas: [first, end) */
+	LLVMMemoryBufferRef bitcode;	/* the whole program, shared */
+	LLVMMemoryBufferRef object;	/* the result */
+	bool failed;			/* an error has been reported */
+	pthread_t thread;
+};
+
+/* decide how many partitions to compile the program in, and which lambdas
+   go where; returns the number of partitions */
+static unsigned int plan_partitions(struct environment *env,
+		struct partition **partsp)
+{
+	struct partition *parts;
+	size_t total = 0, done = 0;
+	unsigned int n, i, k;
+	long cpus;
+
+	for (i = 0; i < env->n_lambdas; i++)
+		total += env->lambdas[i]->n_code + 1;
+
+	if (options.jobs) {
+		n = options.jobs;
 	} else {
-		outfp = stdout;
-		outfile = "<stdout>";
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = cpus > 0? cpus : 1;
+		if (n > total / MIN_PARTITION_CODE)
+			n = total / MIN_PARTITION_CODE;
+	}
+	/* bitcode, IR and assembly are written as one file */
+	if (!options.run && options.emit != EMIT_OBJ && options.emit != EMIT_EXE)
+		n = 1;
+	if (n > env->n_lambdas)
+		n = env->n_lambdas;
+	if (n == 0)
+		n = 1;
+
+	/* give each partition about the same amount of code */
+	parts = xmalloc(n * sizeof(*parts));
+	for (i = k = 0; k < n; k++) {
+		parts[k].index = k;
+		parts[k].first = i;
+		while (i < env->n_lambdas &&
+				(k == n - 1 || done < total * (k + 1) / n)) {
+			done += env->lambdas[i]->n_code + 1;
+			i++;
+		}
+		parts[k].end = i;
 	}
 
-	/* that saves us from a bit of work */
-	memset(&env, 0, sizeof(env));
+	*partsp = parts;
+	return n;
+}
 
-	env.fp = infp;
-	env.file = infile;
-	env.module = LLVMModuleCreateWithName("llfalse");
+static bool is_local(LLVMValueRef v)
+{
+	LLVMLinkage lk = LLVMGetLinkage(v);
 
-	prepare_env(&env);
+	return lk == LLVMPrivateLinkage || lk == LLVMInternalLinkage;
+}
 
-	main_l = l_new(&env);
-	parse_lambda(main_l);
+/* strings may be copied, see build_string */
+static bool is_copyable(LLVMValueRef v)
+{
+	return LLVMIsGlobalConstant(v) &&
+		LLVMGetUnnamedAddress(v) == LLVMGlobalUnnamedAddr;
+}
 
-	env.func_lambda_0 = main_l->fn;
-	finish_env(&env);
+/* make a definition visible to the other partitions */
+static void export_symbol(LLVMValueRef v)
+{
+	if (is_local(v) && !is_copyable(v)) {
+		LLVMSetLinkage(v, LLVMExternalLinkage);
+		LLVMSetVisibility(v, LLVMHiddenVisibility);
+	}
+}
 
-	LLVMVerifyModule(env.module, LLVMPrintMessageAction, NULL);
+static void export_symbols(LLVMModuleRef module)
+{
+	LLVMValueRef v;
+
+	for (v = LLVMGetFirstFunction(module); v; v = LLVMGetNextFunction(v))
+		if (!LLVMIsDeclaration(v))
+			export_symbol(v);
+	for (v = LLVMGetFirstGlobal(module); v; v = LLVMGetNextGlobal(v))
+		if (!LLVMIsDeclaration(v))
+			export_symbol(v);
+}
 
-	/* (0,0 means shouln't close, not unbuffered) */
-	LLVMWriteBitcodeToFD(env.module, fileno(outfp), 0, 0);
+/* does partition p own the definition v? */
+static bool owns(struct partition *p, LLVMValueRef v)
+{
+	const char *name = LLVMGetValueName(v);
+	unsigned long id;
+	char *end;
+
+	if (LLVMIsAFunction(v) && !strncmp(name, "lambda_", 7)) {
+		id = strtoul(name + 7, &end, 10);
+		if (!*end)
+			return id >= p->first && id < p->end;
+	}
 
-	LLVMDisposeModule(env.module);
+	return p->index == 0 || is_local(v);
 }
 
-int main(int argc, char **argv)
+/* turn the definition v into a declaration. Functions lose their bodies in
+   place, because replacing them would rebuild the lambda table each time. */
+static void drop_definition(LLVMModuleRef module, LLVMValueRef v)
 {
-	const char *infile, *outfile;
+	LLVMBasicBlockRef bb;
+	LLVMValueRef insn, decl;
+	const char *name;
+	char *copy;
+	size_t len;
+
+	if (LLVMIsAFunction(v)) {
+		for (bb = LLVMGetFirstBasicBlock(v); bb; bb = LLVMGetNextBasicBlock(bb))
+			for (insn = LLVMGetFirstInstruction(bb); insn;
+					insn = LLVMGetNextInstruction(insn))
+				LLVMReplaceAllUsesWith(insn,
+						LLVMGetUndef(LLVMTypeOf(insn)));
+		for (bb = LLVMGetFirstBasicBlock(v); bb; bb = LLVMGetNextBasicBlock(bb))
+			while ((insn = LLVMGetFirstInstruction(bb)))
+				LLVMInstructionEraseFromParent(insn);
+		while ((bb = LLVMGetFirstBasicBlock(v)))
+			LLVMDeleteBasicBlock(bb);
+		/* declarations can't have a DISubprogram */
+		LLVMGlobalEraseMetadata(v, LLVMGetMDKindID("dbg", 3));
+		return;
+	}
 
-	/* options */
-	parse_cmdline(argc, argv);
-	infile = NULL; /* TODO */
-	outfile = NULL;
-	/* TODO: don't print bitcode to a terminal without being asked */
+	decl = LLVMAddGlobal(module, LLVMGlobalGetValueType(v), "");
+	LLVMSetVisibility(decl, LLVMGetVisibility(v));
+	LLVMReplaceAllUsesWith(v, decl);
+
+	/* the name is only free once v is gone */
+	name = LLVMGetValueName2(v, &len);
+	copy = xmalloc(len);
+	memcpy(copy, name, len);
+	LLVMDeleteGlobal(v);
+	LLVMSetValueName2(decl, copy, len);
+	free(copy);
+}
 
-	compile_file(infile, outfile);
+/* is v used by code or by an initializer (possibly through constant
+   expressions)? */
+static bool is_used(LLVMValueRef v)
+{
+	LLVMUseRef use;
+	LLVMValueRef user;
+
+	for (use = LLVMGetFirstUse(v); use; use = LLVMGetNextUse(use)) {
+		user = LLVMGetUser(use);
+		if (!LLVMIsAConstant(user) || LLVMIsAGlobalValue(user) ||
+		    is_used(user))
+			return true;
+	}
+	return false;
+}
 
-	return EXIT_SUCCESS;
+/* drop the strings that partition p doesn't use */
+static void drop_unused_copies(LLVMModuleRef module)
+{
+	LLVMValueRef v, next;
+
+	for (v = LLVMGetFirstGlobal(module); v; v = next) {
+		next = LLVMGetNextGlobal(v);
+		if (is_local(v) && !is_used(v)) {
+			/* there may be dead constant expressions left */
+			LLVMReplaceAllUsesWith(v, LLVMGetUndef(LLVMTypeOf(v)));
+			LLVMDeleteGlobal(v);
+		}
+	}
+}
+
+/* this runs in a thread of its own (except for partition 0), so errors are
+   left to compile_partitions to act upon */
+static void *compile_partition(void *arg)
+{
+	struct partition *p = arg;
+	LLVMContextRef context;
+	LLVMMemoryBufferRef buf;
+	LLVMModuleRef module;
+	LLVMTargetMachineRef tm;
+	LLVMValueRef v, next;
+	char *msg;
+
+	context = LLVMContextCreate();
+	buf = LLVMCreateMemoryBufferWithMemoryRange(
+			LLVMGetBufferStart(p->bitcode),
+			LLVMGetBufferSize(p->bitcode), "llfalse", false);
+	if (LLVMParseBitcodeInContext2(context, buf, &module)) {
+		fprintf(stderr, "error: Can't read partition %u\n", p->index);
+		LLVMDisposeMemoryBuffer(buf);
+		LLVMContextDispose(context);
+		p->failed = true;
+		return NULL;
+	}
+	LLVMDisposeMemoryBuffer(buf);
+
+	for (v = LLVMGetFirstFunction(module); v; v = next) {
+		next = LLVMGetNextFunction(v);
+		if (!LLVMIsDeclaration(v) && !owns(p, v))
+			drop_definition(module, v);
+	}
+	for (v = LLVMGetFirstGlobal(module); v; v = next) {
+		next = LLVMGetNextGlobal(v);
+		if (!LLVMIsDeclaration(v) && !owns(p, v))
+			drop_definition(module, v);
+	}
+	drop_unused_copies(module);
+
+	tm = create_target_machine(module);
+	optimize_module(module, tm);
+	if (LLVMTargetMachineEmitToMemoryBuffer(tm, module, LLVMObjectFile,
+				&msg, &p->object)) {
+		fprintf(stderr, "error: code generation failed: %s\n", msg);
+		LLVMDisposeMessage(msg);
+		p->failed = true;
+	}
+
+	LLVMDisposeTargetMachine(tm);
+	LLVMDisposeModule(module);
+	LLVMContextDispose(context);
+	return NULL;
+}
+
+/* compile the partitions in parallel; this disposes of the module */
+static void compile_partitions(LLVMModuleRef module, struct partition *parts,
+		unsigned int n)
+{
+	LLVMMemoryBufferRef bitcode;
+	unsigned int i, started;
+	bool failed = false;
+	int err;
+
+	export_symbols(module);
+	bitcode = LLVMWriteBitcodeToMemoryBuffer(module);
+	LLVMDisposeModule(module);
+
+	for (i = 0; i < n; i++) {
+		parts[i].bitcode = bitcode;
+		parts[i].failed = false;
+	}
+
+	/* this thread does partition 0. The others must be done before we may
+	   exit, as exit() tears down LLVM under their feet. */
+	for (started = 1; started < n; started++) {
+		err = pthread_create(&parts[started].thread, NULL,
+				compile_partition, &parts[started]);
+		if (err) {
+			fprintf(stderr, "error: Can't create a thread: %s\n",
+					strerror(err));
+			failed = true;
+			break;
+		}
+	}
+	if (!failed)
+		compile_partition(&parts[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(parts[i].thread, NULL);
+
+	LLVMDisposeMemoryBuffer(bitcode);
+
+	for (i = 0; i < n; i++)
+		failed = failed || parts[i].failed;
+	if (failed)
+		exit(EXIT_FAILURE);
+}
+
+/* write the output to outfile. Object files (of which there may be several,
+   see compile_partitions) are linked into an executable for --emit=exe, and
+   into one relocatable object file for --emit=obj. */
+static void write_output(LLVMMemoryBufferRef *bufs, unsigned int n,
+		const char *outfile)
+{
+	static const char template[] = "/tmp/llfalse-XXXXXX";
+	char **objects, combined[] = "/tmp/llfalse-XXXXXX";
+	const char **argv;
+	LLVMMemoryBufferRef buf;
+	unsigned int i;
+	FILE *fp;
+	char *msg;
+
+	if (options.emit != EMIT_EXE && n == 1) {
+		if (outfile) {
+			fp = xfopen(outfile, "w");
+			write_memory_buffer(bufs[0], fp, outfile);
+			fclose(fp);
+		} else {
+			write_memory_buffer(bufs[0], stdout, "<stdout>");
+		}
+		LLVMDisposeMemoryBuffer(bufs[0]);
+		return;
+	}
+
+	objects = xmalloc(n * sizeof(*objects));
+	for (i = 0; i < n; i++) {
+		objects[i] = xmalloc(sizeof(template));
+		strcpy(objects[i], template);
+		fp = create_temp_file(objects[i]);
+		write_memory_buffer(bufs[i], fp, objects[i]);
+		fclose(fp);
+		LLVMDisposeMemoryBuffer(bufs[i]);
+	}
+
+	if (options.emit == EMIT_EXE) {
+		link_executable(objects, n, outfile? outfile : "a.out");
+	} else {
+		/* "cc -r" can't write to a pipe */
+		if (!outfile)
+			fclose(create_temp_file(combined));
+
+		argv = xmalloc((n + 6) * sizeof(*argv));
+		argv[1] = "-nostdlib";
+		argv[2] = "-r";
+		argv[3] = "-o";
+		argv[4] = outfile? outfile : combined;
+		for (i = 0; i < n; i++)
+			argv[5 + i] = objects[i];
+		argv[5 + n] = NULL;
+		run_cc(argv, argv[4]);
+		free(argv);
+
+		if (!outfile) {
+			if (LLVMCreateMemoryBufferWithContentsOfFile(combined,
+						&buf, &msg)) {
+				fprintf(stderr, "error: Can't read '%s': %s\n",
+						combined, msg);
+				exit(EXIT_FAILURE);
+			}
+			write_memory_buffer(buf, stdout, "<stdout>");
+			LLVMDisposeMemoryBuffer(buf);
+			unlink(combined);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		unlink(objects[i]);
+		free(objects[i]);
+	}
+	free(objects);
+}
+
+static void check_orc_error(LLVMErrorRef err, const char *what)
+{
+	char *msg;
+
+	if (!err)
+		return;
+
+	msg = LLVMGetErrorMessage(err);
+	fprintf(stderr, "error: %s: %s\n", what, msg);
+	LLVMDisposeErrorMessage(msg);
+	exit(EXIT_FAILURE);
+}
+
+/* the libfalse functions, which are linked into llfalse for --run */
+static const struct {
+	const char *name;
+	uintptr_t addr;
+} runtime_symbols[] = {
+	{ "lf_printnum",	(uintptr_t) lf_printnum },
+	{ "lf_printunum",	(uintptr_t) lf_printunum },
+	{ "lf_printstring",	(uintptr_t) lf_printstring },
+	{ "lf_putchar",		(uintptr_t) lf_putchar },
+	{ "lf_getchar",		(uintptr_t) lf_getchar },
+	{ "lf_flush",		(uintptr_t) lf_flush },
+	{ "lf_run",		(uintptr_t) lf_run },
+	{ "lf_stack_init",	(uintptr_t) lf_stack_init },
+	{ "lf_profile_value",	(uintptr_t) lf_profile_value },
+	{ "lf_profile_write",	(uintptr_t) lf_profile_write },
+};
+#define N_RUNTIME_SYMBOLS (sizeof(runtime_symbols) / sizeof(*runtime_symbols))
+
+/*
+ * The JIT's object layer tells gdb about the code it loads, through gdb's
+ * JIT interface, like lli does. With -g, gdb then knows the False source
+ * positions, too. With --perf, the code and its line table also go to a
+ * jitdump file, which "perf inject --jit" merges into a perf.data file that
+ * was recorded with "perf record -k 1".
+ */
+static LLVMOrcObjectLayerRef create_object_layer(void *ctx,
+		LLVMOrcExecutionSessionRef es, const char *triple)
+{
+	LLVMOrcObjectLayerRef layer;
+	LLVMJITEventListenerRef perf;
+
+	(void) ctx;
+	(void) triple;
+
+	layer = LLVMOrcCreateRTDyldObjectLinkingLayerWithSectionMemoryManager(es);
+	LLVMOrcRTDyldObjectLinkingLayerRegisterJITEventListener(layer,
+			LLVMCreateGDBRegistrationListener());
+
+	if (options.perf) {
+		/* NULL if LLVM was built without perf support */
+		perf = LLVMCreatePerfJITEventListener();
+		if (!perf) {
+			fprintf(stderr, "error: This LLVM can't write perf jitdump files.\n");
+			exit(EXIT_FAILURE);
+		}
+		LLVMOrcRTDyldObjectLinkingLayerRegisterJITEventListener(layer,
+				perf);
+	}
+
+	return layer;
+}
+
+/* create a JIT, in which the lf_* functions resolve to the ones in this
+   process */
+static LLVMOrcLLJITRef create_jit(void)
+{
+	LLVMOrcLLJITBuilderRef builder;
+	LLVMOrcLLJITRef jit;
+	LLVMOrcJITDylibRef jd;
+	LLVMJITCSymbolMapPair symbols[N_RUNTIME_SYMBOLS];
+	unsigned int i;
+
+	builder = LLVMOrcCreateLLJITBuilder();
+	LLVMOrcLLJITBuilderSetObjectLinkingLayerCreator(builder,
+			create_object_layer, NULL);
+	check_orc_error(LLVMOrcCreateLLJIT(&jit, builder), "can't create JIT");
+	jd = LLVMOrcLLJITGetMainJITDylib(jit);
+
+	for (i = 0; i < N_RUNTIME_SYMBOLS; i++) {
+		symbols[i].Name = LLVMOrcLLJITMangleAndIntern(jit,
+				runtime_symbols[i].name);
+		symbols[i].Sym.Address = runtime_symbols[i].addr;
+		symbols[i].Sym.Flags.GenericFlags =
+			LLVMJITSymbolGenericFlagsExported |
+			LLVMJITSymbolGenericFlagsCallable;
+		symbols[i].Sym.Flags.TargetFlags = 0;
+	}
+	check_orc_error(LLVMOrcJITDylibDefine(jd,
+			LLVMOrcAbsoluteSymbols(symbols, N_RUNTIME_SYMBOLS)),
+			"can't define runtime symbols");
+
+	/* a runtime linked in with --runtime needs the C library */
+	if (options.runtime) {
+		LLVMOrcDefinitionGeneratorRef gen;
+
+		check_orc_error(LLVMOrcCreateDynamicLibrarySearchGeneratorForProcess(
+				&gen, LLVMOrcLLJITGetGlobalPrefix(jit), NULL, NULL),
+				"can't create symbol generator");
+		LLVMOrcJITDylibAddGenerator(jd, gen);
+	}
+
+	return jit;
+}
+
+/* load the object files into a JIT and run the program; the JIT takes
+   ownership of the objects */
+static int run_objects(LLVMMemoryBufferRef *objects, unsigned int n,
+		const char *file)
+{
+	LLVMOrcLLJITRef jit;
+	LLVMOrcExecutorAddress main_addr;
+	int (*main_fn)(int, char **);
+	char *argv[2];
+	unsigned int i;
+	int ret;
+
+	jit = create_jit();
+
+	for (i = 0; i < n; i++)
+		check_orc_error(LLVMOrcLLJITAddObjectFile(jit,
+				LLVMOrcLLJITGetMainJITDylib(jit), objects[i]),
+				"can't add object file to JIT");
+
+	check_orc_error(LLVMOrcLLJITLookup(jit, &main_addr, "main"),
+			"can't look up main");
+
+	main_fn = (int (*)(int, char **)) main_addr;
+	argv[0] = (char *) file;
+	argv[1] = NULL;
+	ret = main_fn(1, argv);
+
+	check_orc_error(LLVMOrcDisposeLLJIT(jit), "can't dispose JIT");
+
+	return ret;
+}
+
+/*
+ * Read the whole source code into memory. Regular files are mapped, which
+ * costs nothing up front; everything else (like a pipe) is read into a
+ * buffer.
+ */
+static void read_source(struct environment *env, int fd)
+{
+	unsigned char *buf = NULL;
+	size_t len = 0, size = 0;
+	struct stat st;
+	ssize_t ret;
+	void *map;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			env->src = map;
+			env->src_len = st.st_size;
+			env->src_mapped = true;
+			return;
+		}
+	}
+
+	while (1) {
+		if (len == size) {
+			size = size? 2 * size : 65536;
+			buf = xrealloc(buf, size);
+		}
+		ret = read(fd, buf + len, size - len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			fprintf(stderr, "error: Can't read '%s': %s\n",
+					env->file, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+
+	env->src = buf;
+	env->src_len = len;
+	env->src_mapped = false;
+}
+
+static void free_source(struct environment *env)
+{
+	if (env->src_mapped)
+		munmap((void *) env->src, env->src_len);
+	else
+		free((void *) env->src);
+	env->src = NULL;
+}
+
+/*
+ * The compilation cache. With --cache=DIR (or $LLFALSE_CACHE), the output for
+ * a program is stored in DIR under a hash of its source and of the options
+ * that affect the output, and reused as long as neither changes. An entry
+ * file consists of:
+ *
+ *   CACHE_MAGIC
+ *   the length of the key and the key, a text describing the options
+ *   the length of the source and the source
+ *   the number of outputs, and the length and contents of each output
+ *
+ * Lengths are 64 bit numbers in host byte order. The key and the source are
+ * compared on lookup, so hash collisions only cost a recompilation. Entries
+ * are written to a temporary file and renamed into place, so that llfalse
+ * processes sharing the cache never see a partial entry.
+ */
+#define CACHE_MAGIC "llfalse cache 1\n"
+
+struct cache {
+	char *dir, *path;	/* path is NULL if the cache isn't used */
+	char *key;
+	size_t key_len;
+};
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+/* add the hash of a file that the output depends on to the key */
+static void cache_key_file(FILE *fp, const char *what, const char *file)
+{
+	LLVMMemoryBufferRef buf;
+	char *msg;
+
+	if (LLVMCreateMemoryBufferWithContentsOfFile(file, &buf, &msg)) {
+		fprintf(stderr, "error: Can't read '%s': %s\n", file, msg);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(fp, "%s %016llx\n", what, (unsigned long long)
+			fnv1a(FNV1A_INIT, LLVMGetBufferStart(buf),
+				LLVMGetBufferSize(buf)));
+	LLVMDisposeMemoryBuffer(buf);
+}
+
+struct build_id {
+	const unsigned char *id;
+	size_t len;
+};
+
+/* find the GNU build ID in the notes of the executable, which
+   dl_iterate_phdr() reports first */
+static int find_build_id(struct dl_phdr_info *info, size_t size, void *arg)
+{
+	struct build_id *b = arg;
+	const ElfW(Phdr) *ph;
+	const ElfW(Nhdr) *note;
+	const char *p, *end;
+	size_t align;
+	unsigned int i;
+
+	(void) size;
+	for (i = 0; i < info->dlpi_phnum && !b->id; i++) {
+		ph = &info->dlpi_phdr[i];
+		if (ph->p_type != PT_NOTE)
+			continue;
+		align = ph->p_align == 8? 8 : 4;
+		p = (const char *) (info->dlpi_addr + ph->p_vaddr);
+		end = p + ph->p_memsz;
+		while (p + sizeof(*note) <= end) {
+			note = (const ElfW(Nhdr) *) p;
+			p += sizeof(*note) + ((note->n_namesz + align - 1) & -align);
+			if (note->n_type == NT_GNU_BUILD_ID &&
+			    note->n_namesz == 4 && !memcmp(note + 1, "GNU", 4)) {
+				b->id = (const unsigned char *) p;
+				b->len = note->n_descsz;
+				break;
+			}
+			p += (note->n_descsz + align - 1) & -align;
+		}
+	}
+	return 1;
+}
+
+/* identify this llfalse by its build ID, or if it has none, by the hash of
+   its executable */
+static void cache_key_build(FILE *fp)
+{
+	struct build_id b = { NULL, 0 };
+	size_t i;
+
+	dl_iterate_phdr(find_build_id, &b);
+	if (!b.id) {
+		cache_key_file(fp, "llfalse", "/proc/self/exe");
+		return;
+	}
+
+	fputs("llfalse build id ", fp);
+	for (i = 0; i < b.len; i++)
+		fprintf(fp, "%02x", b.id[i]);
+	fputc('\n', fp);
+}
+
+/* describe the options that affect the output */
+static void cache_make_key(struct cache *c)
+{
+	char *triple, *cpu, *features;
+	FILE *fp;
+
+	fp = open_memstream(&c->key, &c->key_len);
+	if (!fp) {
+		perror("open_memstream");
+		exit(EXIT_FAILURE);
+	}
+
+	/* a different llfalse may generate different code */
+	cache_key_build(fp);
+	fprintf(fp, "LLVM %s\n", LLVM_VERSION_STRING);
+
+	/* --run and --emit=exe use object files, too */
+	fprintf(fp, "emit %s\n", options.run || options.emit == EMIT_EXE?
+			emit_names[EMIT_OBJ] : emit_names[options.emit]);
+	fprintf(fp, "-O%c\n", options.opt_level);
+	fprintf(fp, "unsigned %d, latin1 %d, utf8 %d, int width %u\n",
+			options.unsigned_mode, options.decode_latin1,
+			options.decode_utf8, options.int_width);
+	fprintf(fp, "stack size %u, native stack %llu\n", options.stack_size,
+			(unsigned long long) options.native_stack);
+	fprintf(fp, "profile %d, debug info %d\n", options.profile,
+			options.debug_info);
+
+	get_target(&triple, &cpu, &features);
+	fprintf(fp, "target %s, cpu %s, features %s\n", triple, cpu, features);
+	LLVMDisposeMessage(triple);
+	LLVMDisposeMessage(cpu);
+	LLVMDisposeMessage(features);
+
+	if (options.runtime)
+		cache_key_file(fp, "runtime", options.runtime);
+	if (options.profile_use)
+		cache_key_file(fp, "profile-use", options.profile_use);
+
+	fclose(fp);
+}
+
+/* set up the cache for the program in env, if there is one */
+static void cache_open(struct cache *c, struct environment *env)
+{
+	const char *dir = options.cache_dir;
+	uint64_t hash;
+
+	memset(c, 0, sizeof(*c));
+	if (!dir)
+		dir = getenv("LLFALSE_CACHE");
+	/* a cache hit would swallow the report */
+	if (!dir || !*dir || options.report_effects)
+		return;
+
+	if (mkdir(dir, 0777) && errno != EEXIST) {
+		fprintf(stderr, "warning: Can't create cache directory '%s': %s\n",
+				dir, strerror(errno));
+		return;
+	}
+
+	cache_make_key(c);
+	hash = fnv1a(FNV1A_INIT, c->key, c->key_len);
+	hash = fnv1a(hash, env->src, env->src_len);
+
+	c->path = xmalloc(strlen(dir) + sizeof("/0123456789abcdef"));
+	sprintf(c->path, "%s/%016llx", dir, (unsigned long long) hash);
+	c->dir = xmalloc(strlen(dir) + 1);
+	strcpy(c->dir, dir);
+}
+
+static void cache_close(struct cache *c)
+{
+	free(c->dir);
+	free(c->path);
+	free(c->key);
+}
+
+/* take len bytes from the entry at *p; returns NULL if it's too short */
+static const char *cache_take(const char **p, const char *end, uint64_t len)
+{
+	const char *data = *p;
+
+	if ((uint64_t) (end - data) < len)
+		return NULL;
+	*p += len;
+	return data;
+}
+
+/* take a length and as many bytes, and compare them to data */
+static bool cache_match(const char **p, const char *end, const void *data,
+		uint64_t len)
+{
+	const char *q;
+	uint64_t n;
+
+	if (!(q = cache_take(p, end, sizeof(n))))
+		return false;
+	memcpy(&n, q, sizeof(n));
+	if (n != len || !(q = cache_take(p, end, len)))
+		return false;
+	return !memcmp(q, data, len);
+}
+
+/* look the program up in the cache; returns its outputs, or NULL */
+static LLVMMemoryBufferRef *cache_lookup(struct cache *c,
+		struct environment *env, unsigned int *n)
+{
+	LLVMMemoryBufferRef entry, *bufs = NULL;
+	const char *p, *end, *q;
+	uint64_t count, len, i;
+	char *msg;
+
+	if (!c->path)
+		return NULL;
+	if (LLVMCreateMemoryBufferWithContentsOfFile(c->path, &entry, &msg)) {
+		LLVMDisposeMessage(msg);
+		return NULL;
+	}
+	p = LLVMGetBufferStart(entry);
+	end = p + LLVMGetBufferSize(entry);
+
+	if (!(q = cache_take(&p, end, strlen(CACHE_MAGIC))) ||
+	    memcmp(q, CACHE_MAGIC, strlen(CACHE_MAGIC)) ||
+	    !cache_match(&p, end, c->key, c->key_len) ||
+	    !cache_match(&p, end, env->src, env->src_len) ||
+	    !(q = cache_take(&p, end, sizeof(count))))
+		goto miss;
+	memcpy(&count, q, sizeof(count));
+	if (count == 0 || count > UINT_MAX)
+		goto miss;
+
+	bufs = xmalloc(count * sizeof(*bufs));
+	for (i = 0; i < count; i++) {
+		if (!(q = cache_take(&p, end, sizeof(len))))
+			goto miss;
+		memcpy(&len, q, sizeof(len));
+		if (!(q = cache_take(&p, end, len)))
+			goto miss;
+		bufs[i] = LLVMCreateMemoryBufferWithMemoryRangeCopy(q, len, "");
+	}
+
+	LLVMDisposeMemoryBuffer(entry);
+	*n = count;
+	return bufs;
+
+miss:
+	/* a broken entry is simply replaced */
+	if (bufs)
+		while (i--)
+			LLVMDisposeMemoryBuffer(bufs[i]);
+	free(bufs);
+	LLVMDisposeMemoryBuffer(entry);
+	return NULL;
+}
+
+static bool cache_write(FILE *fp, const void *data, uint64_t len)
+{
+	return fwrite(&len, sizeof(len), 1, fp) == 1 &&
+		fwrite(data, 1, len, fp) == len;
+}
+
+/* store the outputs for the program in the cache */
+static void cache_store(struct cache *c, struct environment *env,
+		LLVMMemoryBufferRef *bufs, unsigned int n)
+{
+	uint64_t count = n;
+	unsigned int i;
+	bool ok;
+	char *tmpname;
+	FILE *fp;
+	int fd;
+
+	if (!c->path)
+		return;
+
+	/* the temporary file must be in the same file system */
+	tmpname = xmalloc(strlen(c->dir) + sizeof("/.tmp-XXXXXX"));
+	sprintf(tmpname, "%s/.tmp-XXXXXX", c->dir);
+	fd = mkstemp(tmpname);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		fprintf(stderr, "warning: Can't write to the cache in '%s': %s\n",
+				c->dir, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmpname);
+		}
+		free(tmpname);
+		return;
+	}
+	fchmod(fd, 0644);
+
+	ok = fputs(CACHE_MAGIC, fp) >= 0 &&
+		cache_write(fp, c->key, c->key_len) &&
+		cache_write(fp, env->src, env->src_len) &&
+		fwrite(&count, sizeof(count), 1, fp) == 1;
+	for (i = 0; ok && i < n; i++)
+		ok = cache_write(fp, LLVMGetBufferStart(bufs[i]),
+				LLVMGetBufferSize(bufs[i]));
+
+	if (fclose(fp) || !ok || rename(tmpname, c->path)) {
+		fprintf(stderr, "warning: Can't write to the cache in '%s': %s\n",
+				c->dir, strerror(errno));
+		unlink(tmpname);
+	}
+	free(tmpname);
+}
+
+/*
+ * --time-report: the wall clock time and the peak RSS after each phase of
+ * the compilation, and some numbers about the program. The phases follow
+ * each other, so that everything between two calls of report_phase() is
+ * accounted to the latter.
+ */
+#define MAX_PHASES 16
+#define MAX_COUNTS 16
+
+static struct {
+	struct timespec start, last;
+	struct {
+		const char *name;
+		double wall;
+		long maxrss; /* KiB */
+	} phases[MAX_PHASES];
+	unsigned int n_phases;
+	struct {
+		const char *name;
+		uint64_t value;
+	} counts[MAX_COUNTS];
+	unsigned int n_counts;
+} report;
+
+static double seconds_between(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static void report_start(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &report.start);
+	report.last = report.start;
+}
+
+/* the phase called name has just ended */
+static void report_phase(const char *name)
+{
+	struct timespec now;
+	struct rusage ru;
+
+	if (!options.time_report || report.n_phases == MAX_PHASES)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &ru);
+	report.phases[report.n_phases].name = name;
+	report.phases[report.n_phases].wall = seconds_between(&report.last, &now);
+	report.phases[report.n_phases].maxrss = ru.ru_maxrss;
+	report.n_phases++;
+	report.last = now;
+}
+
+static void report_count(const char *name, uint64_t value)
+{
+	if (!options.time_report || report.n_counts == MAX_COUNTS)
+		return;
+
+	report.counts[report.n_counts].name = name;
+	report.counts[report.n_counts].value = value;
+	report.n_counts++;
+}
+
+/* count the basic blocks and instructions in the module */
+static void report_ir_counts(LLVMModuleRef module, const char *bbs,
+		const char *insns)
+{
+	LLVMValueRef fn, insn;
+	LLVMBasicBlockRef bb;
+	uint64_t n_bbs = 0, n_insns = 0;
+
+	if (!options.time_report)
+		return;
+
+	for (fn = LLVMGetFirstFunction(module); fn; fn = LLVMGetNextFunction(fn))
+		for (bb = LLVMGetFirstBasicBlock(fn); bb; bb = LLVMGetNextBasicBlock(bb)) {
+			n_bbs++;
+			for (insn = LLVMGetFirstInstruction(bb); insn;
+					insn = LLVMGetNextInstruction(insn))
+				n_insns++;
+		}
+
+	report_count(bbs, n_bbs);
+	report_count(insns, n_insns);
+}
+
+static void print_json_string(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(fp, "\\u%04x", *str);
+		else
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+static void print_report(const char *file)
+{
+	struct timespec now;
+	unsigned int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (options.time_report == REPORT_JSON) {
+		fprintf(stderr, "{\"file\":");
+		print_json_string(stderr, file);
+		fprintf(stderr, ",\"phases\":[");
+		for (i = 0; i < report.n_phases; i++)
+			fprintf(stderr, "%s{\"name\":\"%s\",\"wall\":%.6f,\"maxrss\":%ld}",
+					i? "," : "", report.phases[i].name,
+					report.phases[i].wall, report.phases[i].maxrss);
+		fprintf(stderr, "],\"total\":%.6f,\"counts\":{",
+				seconds_between(&report.start, &now));
+		for (i = 0; i < report.n_counts; i++)
+			fprintf(stderr, "%s\"%s\":%llu", i? "," : "",
+					report.counts[i].name,
+					(unsigned long long) report.counts[i].value);
+		fprintf(stderr, "}}\n");
+		return;
+	}
+
+	fprintf(stderr, "Time report for %s:\n", file);
+	fprintf(stderr, "  %-24s %10s %15s\n", "phase", "wall (s)", "peak RSS (KiB)");
+	for (i = 0; i < report.n_phases; i++)
+		fprintf(stderr, "  %-24s %10.6f %15ld\n", report.phases[i].name,
+				report.phases[i].wall, report.phases[i].maxrss);
+	fprintf(stderr, "  %-24s %10.6f\n", "total",
+			seconds_between(&report.start, &now));
+	for (i = 0; i < report.n_counts; i++)
+		fprintf(stderr, "  %-24s %10llu\n", report.counts[i].name,
+				(unsigned long long) report.counts[i].value);
+}
+
+/* compile the program; returns the outputs (see emit_module), of which
+   there are *n */
+static LLVMMemoryBufferRef *compile_program(struct environment *env,
+		unsigned int *n)
+{
+	struct lambda *main_l;
+	struct partition *parts;
+	LLVMMemoryBufferRef *bufs;
+	LLVMTargetMachineRef tm;
+	unsigned int i, n_parts;
+	uint64_t n_code = 0;
+
+	env->module = LLVMModuleCreateWithName("llfalse");
+	tm = create_target_machine(env->module);
+
+	prepare_env(env);
+	report_phase("prepare_env");
+
+	main_l = l_new(env, 0);
+	parse_lambda(main_l);
+	report_phase("parse");
+
+	analyze_program(env);
+	if (!options.stack_size) {
+		if (main_l->effect.state == EFFECT_FIXED)
+			options.stack_size = main_l->effect.max_depth + 1;
+		else
+			options.stack_size = DEFAULT_STACKSIZE;
+	}
+
+	report_phase("stack effects");
+
+	if (options.profile || options.profile_use || options.debug_info)
+		locate_code(env);
+	if (options.debug_info)
+		prepare_debug_info(env);
+	if (options.profile || options.profile_use) {
+		if (options.profile)
+			prepare_profile(env);
+		if (options.profile_use)
+			load_profile(env, options.profile_use);
+		report_phase("profile");
+	}
+
+	for (i = 0; i < env->n_lambdas; i++)
+		gen_lambda(env->lambdas[i]);
+	if (options.profile_use)
+		check_profile(env, options.profile_use);
+	report_phase("code generation");
+
+	env->func_lambda_0 = main_l->fn;
+	finish_env(env);
+	if (options.debug_info) {
+		LLVMDIBuilderFinalize(env->dibuilder);
+		LLVMDisposeDIBuilder(env->dibuilder);
+	}
+	n_parts = plan_partitions(env, &parts);
+	report_phase("finish_env");
+
+	report_count("source bytes", env->src_len);
+	report_count("lambdas", env->n_lambdas);
+	for (i = 0; i < env->n_lambdas; i++)
+		n_code += env->lambdas[i]->n_code;
+	report_count("instructions", n_code);
+	report_count("strings", env->string_id);
+	report_ir_counts(env->module, "basic blocks", "IR instructions");
+
+	/* the front end's data isn't needed anymore */
+	LLVMDisposeBuilder(env->builder);
+	free(env->vs);
+	free(env->lambdas);
+	arena_free(&env->arena);
+
+	LLVMVerifyModule(env->module, LLVMPrintMessageAction, NULL);
+	report_phase("verify");
+	if (options.runtime) {
+		link_runtime(env->module, options.runtime);
+		report_phase("link runtime");
+	}
+
+	bufs = xmalloc(n_parts * sizeof(*bufs));
+	if (n_parts > 1) {
+		compile_partitions(env->module, parts, n_parts);
+		for (i = 0; i < n_parts; i++)
+			bufs[i] = parts[i].object;
+		report_phase("optimize and emit");
+		report_count("partitions", n_parts);
+	} else {
+		optimize_module(env->module, tm);
+		report_phase("optimize");
+		report_ir_counts(env->module, "optimized basic blocks",
+				"optimized IR instructions");
+		bufs[0] = emit_module(env->module, tm);
+		report_phase("emit");
+		LLVMDisposeModule(env->module);
+	}
+
+	free(parts);
+	LLVMDisposeTargetMachine(tm);
+	*n = n_parts;
+	return bufs;
+}
+
+/*
+ * --interpret: Run the parsed program without LLVM, which starts much
+ * faster than compiling it, but runs slower. Each lambda is translated into
+ * direct threaded code: a sequence of cells, each of which is either the
+ * address of the code for an instruction (a label, with GNU C's "labels as
+ * values"), or an operand of the instruction before it. Literal lambdas
+ * that are called, or used with '?' and '#', are called directly. Calls go
+ * through a return stack of our own, so that deep recursion doesn't need a
+ * big native stack. The False stack and the I/O are libfalse's, as for
+ * compiled programs.
+ */
+union cell {
+	const void *op;
+	uint32_t value;
+	const char *str;
+	const union cell *target;	/* of a jump, or a return address */
+};
+
+/* the instructions of the threaded code that aren't opcodes */
+enum {
+	TC_RET = 128,
+	TC_HALT,		/* the end of the program */
+	TC_CALL_LAMBDA,		/* call the lambda whose id follows */
+	TC_IF_LAMBDA,		/* "[...]?" */
+	TC_JUMP,		/* to the target that follows */
+	TC_LOOP_JUMP,		/* count an iteration of a '#', then jump */
+	TC_JUMP_IF_ZERO,	/* pop, and jump if it is 0 */
+	TC_LOOP_COND,		/* call the condition of the innermost '#' */
+	TC_LOOP_TEST,		/* pop, and leave the loop if it is 0 */
+	TC_LOOP_BODY,		/* call the body of the innermost '#' */
+	N_TC,
+};
+
+/* the most cells one instruction is translated into (a '#') */
+#define MAX_CELLS_PER_INSN 8
+
+/* the jump back to the start of a loop in l; --tiered counts the iterations
+   for l, see tier_lookup(). Lambda 0 only runs once, compiling it wouldn't
+   help. */
+static union cell *translate_loop_jump(struct lambda *l, union cell *c,
+		const union cell *loop, const void *const *labels)
+{
+	if (options.tiered && l->id) {
+		c++->op = labels[TC_LOOP_JUMP];
+		c++->value = l->id;
+	} else {
+		c++->op = labels[TC_JUMP];
+	}
+	c++->target = loop;
+	return c;
+}
+
+static union cell *translate_lambda(struct lambda *l, union cell *c,
+		const void *const *labels)
+{
+	struct insn *insn, *end = l->code + l->n_code;
+	union cell *loop, *exit;
+
+	for (insn = l->code; insn < end; insn++) {
+		/* "[...]!" and "[...]?" */
+		if (insn->op == OP_LAMBDA && insn + 1 < end &&
+		    (insn[1].op == OP_CALL || insn[1].op == OP_IF)) {
+			c++->op = labels[insn[1].op == OP_CALL?
+				TC_CALL_LAMBDA : TC_IF_LAMBDA];
+			c++->value = insn->u.lambda->id;
+			insn++;
+			continue;
+		}
+		/* "[...][...]#" */
+		if (insn->op == OP_LAMBDA && insn + 2 < end &&
+		    insn[1].op == OP_LAMBDA && insn[2].op == OP_WHILE) {
+			loop = c;
+			c++->op = labels[TC_CALL_LAMBDA];
+			c++->value = insn->u.lambda->id;
+			c++->op = labels[TC_JUMP_IF_ZERO];
+			exit = c++;
+			c++->op = labels[TC_CALL_LAMBDA];
+			c++->value = insn[1].u.lambda->id;
+			c = translate_loop_jump(l, c, loop, labels);
+			exit->target = c;
+			insn += 2;
+			continue;
+		}
+
+		c++->op = labels[insn->op];
+		switch (insn->op) {
+		case OP_PUSH:
+		case OP_STORE_VAR:
+		case OP_LOAD_VAR:
+		case OP_ADD_CONST:
+		case OP_PICK_CONST:
+			c++->value = insn->u.value;
+			break;
+		case OP_LAMBDA:
+			c++->value = insn->u.lambda->id;
+			break;
+		case OP_STRING:
+			c++->str = insn->u.str.text;
+			break;
+		case OP_WHILE:
+			/* OP_WHILE moves the lambdas to the return stack */
+			loop = c;
+			c++->op = labels[TC_LOOP_COND];
+			c++->op = labels[TC_LOOP_TEST];
+			exit = c++;
+			c++->op = labels[TC_LOOP_BODY];
+			c = translate_loop_jump(l, c, loop, labels);
+			exit->target = c;
+			break;
+		default:
+			break;
+		}
+	}
+	c++->op = labels[TC_RET];
+
+	return c;
+}
+
+typedef void (*lambda_t)(void);
+
+/*
+ * The state of the threaded code that outlives a call of execute(). With
+ * --tiered, the compiled code shares the stack and the variables, see
+ * tier_symbols().
+ */
+static struct {
+	const union cell **lambda_code;
+	uint32_t n_lambdas;
+	uint32_t *stack;	/* stack[0] is below the bottom */
+	uint32_t stack_index;	/* of the top, while no threaded code runs */
+	uint32_t vars[26];
+	union cell *rstack;	/* the return stack */
+	size_t rsize, rdepth;	/* rdepth: the top, like stack_index */
+
+	/* --tiered, see tier_lookup() */
+	lambda_t *native;	/* the compiled code of each lambda, or NULL */
+	uint32_t *counts;	/* calls and loop iterations of each lambda */
+} tc;
+
+/*
+ * --tiered: The program starts in the interpreter, which counts how often
+ * each lambda is called, and how often its loops go around. A lambda whose
+ * count reaches options.tiered is queued, and a thread of its own compiles
+ * what is in the queue, with the same code generation as --run, into a
+ * module per batch, which is added to a JIT. The functions then replace the
+ * threaded code in tc.native, which is what the interpreter looks at before
+ * it calls a lambda. A lambda that is already running stays in the
+ * interpreter until it returns, so a loop makes the next call of its lambda
+ * faster.
+ *
+ * The compiled code only declares the globals that it would define, they
+ * are tc's. It calls the lambdas that it doesn't know, and those that
+ * aren't compiled yet, through tier_call(), which either calls their
+ * compiled code or interprets them.
+ */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t *queue;	/* the lambdas to compile next */
+	unsigned int n_queued;
+	bool busy;		/* a batch is being compiled */
+	bool done;		/* the program has ended */
+} tier = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* have lambda id compiled */
+static void tier_queue(uint32_t id)
+{
+	pthread_mutex_lock(&tier.lock);
+	if (tier.n_queued < tc.n_lambdas)
+		tier.queue[tier.n_queued++] = id;
+	pthread_cond_signal(&tier.cond);
+	pthread_mutex_unlock(&tier.lock);
+}
+
+/* count a call of lambda id, or an iteration of one of its loops */
+static void tier_count(uint32_t id)
+{
+	if (++tc.counts[id] == options.tiered)
+		tier_queue(id);
+}
+
+/* returns the compiled code of lambda id, or NULL if it is still
+   interpreted, in which case the call counts */
+static lambda_t tier_lookup(uint32_t id)
+{
+	lambda_t fn = __atomic_load_n(&tc.native[id], __ATOMIC_ACQUIRE);
+
+	if (!fn)
+		tier_count(id);
+	return fn;
+}
+
+static void bad_call(uint32_t id)
+{
+	lf_flush();
+	fprintf(stderr, "error: Can't call %u, it isn't a lambda.\n", id);
+	exit(EXIT_FAILURE);
+}
+
+/* run the threaded code at pc until it returns; execute(NULL) returns the
+   labels for translate_lambda() */
+static const void *const *execute(const union cell *pc)
+{
+	static const void *const labels[N_TC] = {
+		[OP_PUSH] = &&op_push, [OP_LAMBDA] = &&op_push,
+		[OP_STRING] = &&op_string,
+		[OP_STORE] = &&op_store, [OP_LOAD] = &&op_load,
+		[OP_STORE_VAR] = &&op_store_var, [OP_LOAD_VAR] = &&op_load_var,
+		[OP_CALL] = &&op_call,
+		[OP_ADD] = &&op_add, [OP_SUB] = &&op_sub, [OP_MUL] = &&op_mul,
+		[OP_DIV] = &&op_div, [OP_AND] = &&op_and, [OP_OR] = &&op_or,
+		[OP_EQ] = &&op_eq, [OP_GT] = &&op_gt,
+		[OP_NEG] = &&op_neg, [OP_NOT] = &&op_not,
+		[OP_ADD_CONST] = &&op_add_const,
+		[OP_DUP] = &&op_dup, [OP_DROP] = &&op_drop,
+		[OP_SWAP] = &&op_swap, [OP_ROT] = &&op_rot,
+		[OP_PICK] = &&op_pick, [OP_PICK_CONST] = &&op_pick_const,
+		[OP_IF] = &&op_if, [OP_WHILE] = &&op_while,
+		[OP_PRINTNUM] = &&op_printnum, [OP_PUTC] = &&op_putc,
+		[OP_GETC] = &&op_getc, [OP_FLUSH] = &&op_flush,
+		[TC_RET] = &&tc_ret, [TC_HALT] = &&tc_halt,
+		[TC_CALL_LAMBDA] = &&tc_call_lambda,
+		[TC_IF_LAMBDA] = &&tc_if_lambda,
+		[TC_JUMP] = &&tc_jump, [TC_LOOP_JUMP] = &&tc_loop_jump,
+		[TC_JUMP_IF_ZERO] = &&tc_jump_if_zero,
+		[TC_LOOP_COND] = &&tc_loop_cond, [TC_LOOP_TEST] = &&tc_loop_test,
+		[TC_LOOP_BODY] = &&tc_loop_body,
+	};
+	const union cell **lambda_code = tc.lambda_code;
+	union cell halt, *rsp, *rend;
+	uint32_t *sp, a, id, n = tc.n_lambdas;
+	uint32_t *vars = tc.vars;
+	lambda_t fn;
+	size_t i;
+
+	if (!pc)
+		return labels;
+
+	sp = tc.stack + tc.stack_index;
+	rsp = tc.rstack + tc.rdepth;
+	rend = tc.rstack + tc.rsize;
+
+/* make room for n more cells on the return stack */
+#define RESERVE(n)							\
+	do {								\
+		if (rend - rsp <= (n)) {				\
+			tc.rsize *= 2;					\
+			i = rsp - tc.rstack;				\
+			tc.rstack = xrealloc(tc.rstack,			\
+					tc.rsize * sizeof(*tc.rstack));	\
+			rsp = tc.rstack + i;				\
+			rend = tc.rstack + tc.rsize;			\
+		}							\
+	} while (0)
+#define CALL(lambda)							\
+	do {								\
+		id = (lambda);						\
+		if (id >= n)						\
+			bad_call(id);					\
+		if (tc.native)						\
+			goto call_tiered;				\
+		RESERVE(1);						\
+		(++rsp)->target = pc;					\
+		pc = lambda_code[id];					\
+	} while (0)
+#define NEXT goto *(pc++)->op
+#define BINOP(expr)	a = *sp--; *sp = (expr); NEXT
+
+	/* return to a TC_HALT */
+	halt.op = labels[TC_HALT];
+	RESERVE(1);
+	(++rsp)->target = &halt;
+
+	NEXT;
+
+op_push:	*++sp = (pc++)->value; NEXT;
+op_string:	lf_printstring((pc++)->str); NEXT;
+op_store:	a = *sp--; if (a < 26) vars[a] = *sp; sp--; NEXT;
+op_load:	*sp = *sp < 26? vars[*sp] : 0; NEXT;
+op_store_var:	vars[(pc++)->value] = *sp--; NEXT;
+op_load_var:	*++sp = vars[(pc++)->value]; NEXT;
+op_call:	CALL(*sp--); NEXT;
+op_add:		BINOP(*sp + a);
+op_sub:		BINOP(*sp - a);
+op_mul:		BINOP(*sp * a);
+op_div:		BINOP(options.unsigned_mode? *sp / a :
+			(uint32_t) ((int32_t) *sp / (int32_t) a));
+op_and:		BINOP(*sp & a);
+op_or:		BINOP(*sp | a);
+op_eq:		BINOP(*sp == a? ~0U : 0);
+op_gt:		BINOP((options.unsigned_mode? *sp > a :
+			(int32_t) *sp > (int32_t) a)? ~0U : 0);
+op_neg:		*sp = -*sp; NEXT;
+op_not:		*sp = ~*sp; NEXT;
+op_add_const:	*sp += (pc++)->value; NEXT;
+op_dup:		a = *sp; *++sp = a; NEXT;
+op_drop:	sp--; NEXT;
+op_swap:	a = *sp; *sp = sp[-1]; sp[-1] = a; NEXT;
+op_rot:		a = sp[-2]; sp[-2] = sp[-1]; sp[-1] = *sp; *sp = a; NEXT;
+op_pick:	*sp = sp[-1 - (int32_t) *sp]; NEXT;
+op_pick_const:	a = (pc++)->value; sp++; *sp = sp[-1 - (int32_t) a]; NEXT;
+op_if:		a = *sp; sp -= 2; if (sp[1]) CALL(a); NEXT;
+op_while:
+		/* the condition and the body, see TC_LOOP_COND */
+		RESERVE(2);
+		(++rsp)->value = sp[-1];
+		(++rsp)->value = *sp;
+		sp -= 2;
+		NEXT;
+op_printnum:
+		if (options.unsigned_mode)
+			lf_printunum(*sp--);
+		else
+			lf_printnum(*sp--);
+		NEXT;
+op_putc:	lf_putchar(*sp--); NEXT;
+op_getc:	*++sp = lf_getchar(); NEXT;
+op_flush:	lf_flush(); NEXT;
+
+tc_ret:		pc = (rsp--)->target; NEXT;
+tc_call_lambda:	a = (pc++)->value; CALL(a); NEXT;
+tc_if_lambda:	a = (pc++)->value; if (*sp--) CALL(a); NEXT;
+tc_jump:	pc = pc->target; NEXT;
+tc_loop_jump:	tier_count((pc++)->value); pc = pc->target; NEXT;
+tc_jump_if_zero: if (*sp--) pc++; else pc = pc->target; NEXT;
+tc_loop_cond:	CALL(rsp[-1].value); NEXT;
+tc_loop_test:	if (*sp--) pc++; else { rsp -= 2; pc = pc->target; } NEXT;
+tc_loop_body:	CALL(rsp->value); NEXT;
+
+call_tiered:
+		fn = tier_lookup(id);
+		if (!fn) {
+			RESERVE(1);
+			(++rsp)->target = pc;
+			pc = lambda_code[id];
+			NEXT;
+		}
+		tc.stack_index = sp - tc.stack;
+		tc.rdepth = rsp - tc.rstack;
+		fn();
+		/* it may have interpreted lambdas, see tier_call() */
+		sp = tc.stack + tc.stack_index;
+		rsp = tc.rstack + tc.rdepth;
+		rend = tc.rstack + tc.rsize;
+		NEXT;
+
+tc_halt:
+#undef RESERVE
+#undef CALL
+#undef NEXT
+#undef BINOP
+	tc.stack_index = sp - tc.stack;
+	tc.rdepth = rsp - tc.rstack;
+	return labels;
+}
+
+/* the compiled code calls the lambdas that it doesn't know, and those that
+   aren't compiled yet, through this */
+static void tier_call(uint32_t id)
+{
+	lambda_t fn;
+
+	if (id >= tc.n_lambdas)
+		bad_call(id);
+	fn = tier_lookup(id);
+	if (fn)
+		fn();
+	else
+		execute(tc.lambda_code[id]);
+}
+
+/* make the interpreter's state the compiled code's globals */
+static void tier_symbols(LLVMOrcLLJITRef jit)
+{
+	LLVMJITCSymbolMapPair symbols[26 + 3];
+	char name[sizeof("var_x")];
+	unsigned int i;
+
+	for (i = 0; i < 26; i++) {
+		snprintf(name, sizeof(name), "var_%c", 'a' + i);
+		symbols[i].Name = LLVMOrcLLJITMangleAndIntern(jit, name);
+		symbols[i].Sym.Address = (uintptr_t) &tc.vars[i];
+	}
+	symbols[26].Name = LLVMOrcLLJITMangleAndIntern(jit, "stack");
+	symbols[26].Sym.Address = (uintptr_t) &tc.stack;
+	symbols[27].Name = LLVMOrcLLJITMangleAndIntern(jit, "stack_index");
+	symbols[27].Sym.Address = (uintptr_t) &tc.stack_index;
+	symbols[28].Name = LLVMOrcLLJITMangleAndIntern(jit, "tier_call");
+	symbols[28].Sym.Address = (uintptr_t) tier_call;
+
+	for (i = 0; i < 26 + 3; i++) {
+		symbols[i].Sym.Flags.GenericFlags =
+			LLVMJITSymbolGenericFlagsExported;
+		symbols[i].Sym.Flags.TargetFlags = 0;
+	}
+	symbols[28].Sym.Flags.GenericFlags |= LLVMJITSymbolGenericFlagsCallable;
+
+	check_orc_error(LLVMOrcJITDylibDefine(LLVMOrcLLJITGetMainJITDylib(jit),
+			LLVMOrcAbsoluteSymbols(symbols, 26 + 3)),
+			"can't define the interpreter's symbols");
+}
+
+/*
+ * The lambdas that a batch doesn't compile are only declared. Those that
+ * an earlier batch compiled are linked by the JIT. Those that are still
+ * interpreted, but called, get a body that calls tier_call(), and the rest
+ * are dropped.
+ */
+static void build_tier_stubs(struct environment *env)
+{
+	LLVMValueRef id;
+	struct lambda *l;
+	unsigned int i;
+
+	for (i = 0; i < env->n_lambdas; i++) {
+		l = env->lambdas[i];
+		if (!LLVMIsDeclaration(l->fn) || tc.native[i])
+			continue;
+		if (!LLVMGetFirstUse(l->fn)) {
+			LLVMDeleteFunction(l->fn);
+			l->fn = NULL;
+			continue;
+		}
+
+		set_linkage(l->fn, LINKAGE_CODE);
+		LLVMPositionBuilderAtEnd(env->builder,
+				LLVMAppendBasicBlock(l->fn, ""));
+		id = u32_value(l->id);
+		set_tail_call(build_fn_call(env->builder, env->func_tier_call,
+					&id, 1, ""));
+		LLVMBuildRetVoid(env->builder);
+	}
+}
+
+/* compile the lambdas in batch and let the interpreter call them */
+static void compile_batch(struct environment *env, LLVMOrcLLJITRef jit,
+		const uint32_t *batch, unsigned int n)
+{
+	char name[sizeof("lambda_4000000000")];
+	LLVMTargetMachineRef tm;
+	LLVMMemoryBufferRef object;
+	LLVMOrcExecutorAddress addr;
+	struct lambda *l;
+	unsigned int i, j;
+	char *msg;
+
+	env->module = LLVMModuleCreateWithName("llfalse");
+	tm = create_target_machine(env->module);
+	prepare_env(env);
+	if (options.debug_info)
+		prepare_debug_info(env);
+	memset(env->call_var, 0, sizeof(env->call_var));
+	env->func_load_var = env->func_store_var = NULL;
+	/* the strings of earlier batches went with their modules */
+	for (i = 0; i < env->n_lambdas; i++) {
+		l = env->lambdas[i];
+		for (j = 0; j < l->n_code; j++)
+			if (l->code[j].op == OP_STRING)
+				l->code[j].u.str.global = NULL;
+	}
+
+	for (i = 0; i < env->n_lambdas; i++) {
+		snprintf(name, sizeof(name), "lambda_%u", i);
+		env->lambdas[i]->fn = LLVMAddFunction(env->module, name,
+				env->lambda_type);
+	}
+	for (i = 0; i < n; i++)
+		gen_lambda(env->lambdas[batch[i]]);
+	build_var_dispatchers(env);
+	build_var_accessors(env);
+	build_tier_stubs(env);
+	if (options.debug_info) {
+		LLVMDIBuilderFinalize(env->dibuilder);
+		LLVMDisposeDIBuilder(env->dibuilder);
+	}
+	LLVMDisposeBuilder(env->builder);
+
+	optimize_module(env->module, tm);
+	if (LLVMTargetMachineEmitToMemoryBuffer(tm, env->module, LLVMObjectFile,
+				&msg, &object)) {
+		fprintf(stderr, "error: code generation failed: %s\n", msg);
+		exit(EXIT_FAILURE);
+	}
+	LLVMDisposeModule(env->module);
+	env->module = NULL;
+	LLVMDisposeTargetMachine(tm);
+
+	check_orc_error(LLVMOrcLLJITAddObjectFile(jit,
+			LLVMOrcLLJITGetMainJITDylib(jit), object),
+			"can't add object file to JIT");
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "lambda_%u", batch[i]);
+		check_orc_error(LLVMOrcLLJITLookup(jit, &addr, name),
+				"can't look up a compiled lambda");
+		__atomic_store_n(&tc.native[batch[i]], (lambda_t) addr,
+				__ATOMIC_RELEASE);
+	}
+}
+
+static void *tier_thread(void *arg)
+{
+	struct environment *env = arg;
+	LLVMOrcLLJITRef jit = NULL;
+	uint32_t *batch;
+	unsigned int i, n;
+
+	batch = xmalloc(env->n_lambdas * sizeof(*batch));
+	for (;;) {
+		pthread_mutex_lock(&tier.lock);
+		while (!tier.n_queued && !tier.done)
+			pthread_cond_wait(&tier.cond, &tier.lock);
+		if (tier.done) {
+			pthread_mutex_unlock(&tier.lock);
+			break;
+		}
+		/* a lambda that keeps looping in the interpreter after it
+		   was compiled is queued again every 4G iterations */
+		for (i = n = 0; i < tier.n_queued; i++)
+			if (!tc.native[tier.queue[i]])
+				batch[n++] = tier.queue[i];
+		tier.n_queued = 0;
+		tier.busy = n > 0;
+		pthread_mutex_unlock(&tier.lock);
+		if (!n)
+			continue;
+
+		/* short programs never get here, and don't wait for this */
+		if (!jit) {
+			LLVMInitializeNativeTarget();
+			LLVMInitializeNativeAsmPrinter();
+			if (options.profile_use || options.debug_info)
+				locate_code(env);
+			if (options.profile_use)
+				load_profile(env, options.profile_use);
+			jit = create_jit();
+			tier_symbols(jit);
+		}
+		compile_batch(env, jit, batch, n);
+
+		pthread_mutex_lock(&tier.lock);
+		tier.busy = false;
+		pthread_mutex_unlock(&tier.lock);
+	}
+	free(batch);
+
+	if (jit) {
+		free(env->vs);
+		check_orc_error(LLVMOrcDisposeLLJIT(jit), "can't dispose JIT");
+	}
+	return NULL;
+}
+
+static void tier_start(struct environment *env)
+{
+	uint32_t n = env->n_lambdas;
+	int err;
+
+	tc.native = xmalloc(n * sizeof(*tc.native));
+	memset(tc.native, 0, n * sizeof(*tc.native));
+	tc.counts = xmalloc(n * sizeof(*tc.counts));
+	memset(tc.counts, 0, n * sizeof(*tc.counts));
+	tier.queue = xmalloc(n * sizeof(*tier.queue));
+
+	err = pthread_create(&tier.thread, NULL, tier_thread, env);
+	if (err) {
+		fprintf(stderr, "error: Can't create a thread: %s\n",
+				strerror(err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Stop the compiler thread. LLVM can't be interrupted, and a batch that it
+ * is still compiling isn't needed anymore, so the program exits right away
+ * then instead of waiting for it. Only --perf waits, so that the jitdump
+ * file is complete.
+ */
+static void tier_stop(void)
+{
+	bool busy;
+
+	pthread_mutex_lock(&tier.lock);
+	tier.done = true;
+	busy = tier.busy;
+	pthread_cond_signal(&tier.cond);
+	pthread_mutex_unlock(&tier.lock);
+
+	if (busy && !options.perf) {
+		/* exit() would run LLVM's destructors under its feet */
+		fflush(NULL);
+		_exit(EXIT_SUCCESS);
+	}
+	pthread_join(tier.thread, NULL);
+
+	free(tier.queue);
+	free(tc.counts);
+	free(tc.native);
+}
+
+static void run_main(void)
+{
+	execute(tc.lambda_code[0]);
+}
+
+static int interpret(struct environment *env)
+{
+	const void *const *labels = execute(NULL);
+	union cell *code, *c;
+	uint32_t n = env->n_lambdas;
+	size_t size = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		size += MAX_CELLS_PER_INSN * env->lambdas[i]->n_code + 1;
+	code = c = xmalloc(size * sizeof(*code));
+	tc.lambda_code = xmalloc(n * sizeof(*tc.lambda_code));
+	tc.n_lambdas = n;
+	for (i = 0; i < n; i++) {
+		tc.lambda_code[i] = c;
+		c = translate_lambda(env->lambdas[i], c, labels);
+	}
+	report_phase("threaded code");
+	if (options.time_report)
+		print_report(env->file);
+
+	tc.stack = lf_stack_init(options.stack_size, NULL, NULL, 0);
+	tc.rsize = 1024;
+	tc.rstack = xmalloc(tc.rsize * sizeof(*tc.rstack));
+
+	if (options.tiered)
+		tier_start(env);
+	if (options.native_stack)
+		lf_run(run_main, options.native_stack);
+	else
+		run_main();
+	lf_flush();
+	if (options.tiered)
+		tier_stop();
+
+	free(tc.rstack);
+	free(tc.lambda_code);
+	free(code);
+	return EXIT_SUCCESS;
+}
+
+static int interpret_file(struct environment *env)
+{
+	struct lambda *main_l;
+	int ret;
+
+	main_l = l_new(env, 0);
+	parse_lambda(main_l);
+	report_phase("parse");
+
+	analyze_program(env);
+	if (!options.stack_size) {
+		if (main_l->effect.state == EFFECT_FIXED)
+			options.stack_size = main_l->effect.max_depth + 1;
+		else
+			options.stack_size = DEFAULT_STACKSIZE;
+	}
+	report_phase("stack effects");
+
+	ret = interpret(env);
+	free(env->lambdas);
+	arena_free(&env->arena);
+	return ret;
+}
+
+static int compile_file(const char *infile, const char *outfile)
+{
+	struct environment env;
+	struct cache cache;
+	LLVMMemoryBufferRef *outputs;
+	unsigned int n;
+	int ret = EXIT_SUCCESS, fd;
+
+	/* that saves us from a bit of work */
+	memset(&env, 0, sizeof(env));
+
+	if (infile) {
+		fd = open(infile, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "error: Can't open '%s': %s\n",
+					infile, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		fd = STDIN_FILENO;
+		infile = "<stdin>";
+	}
+	env.file = infile;
+	env.pos_line = 1;
+	report_start();
+	read_source(&env, fd);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	report_phase("read source");
+
+	if (options.interpret) {
+		ret = interpret_file(&env);
+		free_source(&env);
+		return ret;
+	}
+
+	LLVMInitializeNativeTarget();
+	LLVMInitializeNativeAsmPrinter();
+
+	cache_open(&cache, &env);
+	outputs = cache_lookup(&cache, &env, &n);
+	if (cache.path)
+		report_phase("cache lookup");
+	if (!outputs) {
+		outputs = compile_program(&env, &n);
+		if (cache.path) {
+			cache_store(&cache, &env, outputs, n);
+			report_phase("cache store");
+		}
+	}
+	cache_close(&cache);
+	free_source(&env);
+
+	if (options.run) {
+		/* report before the program's own output */
+		if (options.time_report)
+			print_report(infile);
+		ret = run_objects(outputs, n, infile);
+	} else {
+		write_output(outputs, n, outfile);
+		report_phase(options.emit == EMIT_EXE? "link" : "write output");
+		if (options.time_report)
+			print_report(infile);
+	}
+
+	free(outputs);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *infile, *outfile;
+
+	/* options */
+	parse_cmdline(argc, argv);
+	infile = options.infile;
+	outfile = options.outfile;
+	/* TODO: don't print bitcode to a terminal without being asked */
+
+	return compile_file(infile, outfile);
 }
@@ -6,12 +6,13 @@
  */
 
 #include <stdio.h>
-#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
-#define MIN(a,b) (((a) < (b))? (a):(b))
+#include "util.h"
+
+#define MAX(a,b) (((a) > (b))? (a):(b))
 
 /* panic-on-OOM allocation functions / other fatal stuff */
 static void oom(size_t sz)
@@ -29,6 +30,14 @@ void *xmalloc(size_t sz)
 	return p;
 }
 
+void *xrealloc(void *p, size_t sz)
+{
+	p = realloc(p, sz);
+	if (!p)
+		oom(sz);
+	return p;
+}
+
 FILE *xfopen(const char *path, const char *mode)
 {
 	FILE *f = fopen(path, mode);
@@ -42,140 +51,71 @@ FILE *xfopen(const char *path, const char *mode)
 }
 
 
-/* the growbuf "library" */
-
-#define GROWBUF_NODE_SIZE 256
+/*
+ * A simple bump allocator: objects are carved out of big blocks one after
+ * the other, and they are all freed at once with arena_free(). A zeroed
+ * struct arena is an empty arena.
+ */
 
-static const char EMPTY_STRING[1];
+#define ARENA_BLOCK_SIZE (256 * 1024)
+#define ARENA_ALIGN 16 /* enough for any type we put there */
 
-struct growbuf_node {
-	struct growbuf_node *next;
-	size_t size, filled;
-	char *buf;
+struct arena_block {
+	struct arena_block *prev;
+	/* the objects follow, suitably aligned */
 };
 
-struct growbuf {
-	struct growbuf_node *first, *last;
-};
+#define ARENA_HEADER_SIZE \
+	((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
 
-struct growbuf *growbuf_new(void)
+void *arena_alloc(struct arena *a, size_t sz)
 {
-	struct growbuf *buf = xmalloc(sizeof(*buf));
-
-	buf->first = NULL;
-	buf->last = NULL;
-
-	return buf;
-}
-
-void growbuf_free(struct growbuf *buf)
-{
-	struct growbuf_node *node, *next;
-
-	assert(buf);
-
-	for (node = buf->first; node; node = next) {
-		next = node->next;
-
-		assert(node->buf);
-		free(node->buf);
-		free(node);
+	struct arena_block *block;
+	size_t block_size;
+	char *p;
+
+	sz = (sz + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if (sz > (size_t) (a->end - a->ptr)) {
+		/* big objects get a block of their own */
+		block_size = ARENA_HEADER_SIZE + MAX(sz, ARENA_BLOCK_SIZE);
+		block = xmalloc(block_size);
+		block->prev = a->blocks;
+		a->blocks = block;
+		a->ptr = (char *) block + ARENA_HEADER_SIZE;
+		a->end = (char *) block + block_size;
 	}
 
-	free(buf);
-}
-
-static struct growbuf_node *growbuf_new_node(void)
-{
-	struct growbuf_node *node = xmalloc(sizeof(*node));
-
-	node->next = NULL;
-	node->size = GROWBUF_NODE_SIZE;
-	node->filled = 0;
-	node->buf = xmalloc(node->size);
-
-	return node;
+	p = a->ptr;
+	a->ptr += sz;
+	a->last = p;
+	return p;
 }
 
-static void growbuf_check_node(struct growbuf *buf)
+/* resize p, which was allocated from a with old_sz bytes. This happens in
+   place if p is the most recent allocation and there's room behind it */
+void *arena_grow(struct arena *a, void *p, size_t old_sz, size_t sz)
 {
-	assert(buf);
-
-	if (!buf->last) {
-		assert(buf->first == NULL);
-		buf->last = buf->first = growbuf_new_node();
-	}
+	void *new_p;
 
-	if (buf->last->filled == buf->last->size) {
-		struct growbuf_node *node = growbuf_new_node();
-		assert(buf->last->next == NULL);
-		buf->last->next = node;
-		buf->last = node;
+	if (p && p == a->last && sz <= (size_t) (a->end - (char *) p)) {
+		a->ptr = (char *) p +
+			((sz + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1));
+		return p;
 	}
-}
-
-void growbuf_add(struct growbuf *buf, const char *text, size_t len)
-{
-	while (len) {
-		growbuf_check_node(buf);
-		size_t to_copy = MIN(len, buf->last->size - buf->last->filled);
-		memcpy(buf->last->buf + buf->last->filled, text, to_copy);
-		text += to_copy;
-		len -= to_copy;
-		buf->last->filled += to_copy;
-	}
-}
-
-size_t growbuf_len(struct growbuf *buf)
-{
-	size_t len = 0;
-	struct growbuf_node *node;
 
-	assert(buf != NULL);
-
-	for (node = buf->first; node; node = node->next)
-		len += node->filled;
-
-	return len;
+	new_p = arena_alloc(a, sz);
+	if (p)
+		memcpy(new_p, p, old_sz);
+	return new_p;
 }
 
-static void growbuf_concat(struct growbuf *buf)
+void arena_free(struct arena *a)
 {
-	char *dst, *p;
-	size_t size;
-	struct growbuf_node *node, *next;
-
-	assert(buf != NULL);
-
-	if (buf->first == NULL || buf->first->next == NULL)
-		return;
-
-	size = growbuf_len(buf);
-	p = dst = xmalloc(size);
-
-	for (node = buf->first; node; node = next) {
-		memcpy(p, node->buf, node->filled);
-		p += node->filled;
+	struct arena_block *block, *prev;
 
-		free(node->buf);
-		next = node->next;
-		free(node);
+	for (block = a->blocks; block; block = prev) {
+		prev = block->prev;
+		free(block);
 	}
-
-	node = xmalloc(sizeof(*node));
-	node->next = NULL;
-	node->size = size;
-	node->filled = size;
-	node->buf = dst;
-	buf->last = buf->first = node;
-}
-
-const char *growbuf_buf(struct growbuf *buf)
-{
-	assert(buf != NULL);
-
-	growbuf_concat(buf);
-	if (buf->first)
-		return buf->first->buf;
-	return EMPTY_STRING;
+	memset(a, 0, sizeof(*a));
 }
@@ -8,11 +8,15 @@
 #include <stdlib.h>
 
 void *xmalloc(size_t sz);
+void *xrealloc(void *p, size_t sz);
 FILE *xfopen(const char *path, const char *mode);
 
-struct growbuf;
-struct growbuf *growbuf_new(void);
-void growbuf_free(struct growbuf *buf);
-void growbuf_add(struct growbuf *buf, const char *text, size_t length);
-const char *growbuf_buf(struct growbuf *buf);
-size_t growbuf_len(struct growbuf *buf);
+struct arena_block;
+struct arena {
+	struct arena_block *blocks;
+	char *ptr, *end;	/* the free part of the current block */
+	void *last;		/* the most recent allocation */
+};
+void *arena_alloc(struct arena *a, size_t sz);
+void *arena_grow(struct arena *a, void *p, size_t old_sz, size_t sz);
+void arena_free(struct arena *a);